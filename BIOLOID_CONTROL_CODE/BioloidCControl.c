@@ -43,6 +43,13 @@
 #include "motion_f.h"
 #include "clock.h"
 #include "walk.h"
+#include "motion_image.h"
+#include "scheduler.h"
+#include "profile.h"
+#include "tick.h"
+#include "mailbox.h"
+#include "latency.h"
+#include "watchdog.h"
 
 // Array showing which Dynamixel servos are enabled (ID from 0 to 25)
 #ifdef HUMANOID_TYPEA
@@ -72,6 +79,9 @@ volatile bool button_down_pressed = FALSE;
 volatile bool button_left_pressed = FALSE;
 volatile bool button_right_pressed = FALSE;
 volatile bool start_button_pressed = FALSE;
+// set by the balance task, task_command posts the safety command
+// (MAILBOX_SAFETY keeps a single writer)
+volatile bool low_battery_alarm = FALSE;
 
 // Buzzer related global variables
 volatile unsigned char buzzerFinished = 0;	// flag: 0 while playing
@@ -103,12 +113,18 @@ volatile uint8 last_bioloid_command = 0;	// last command
 volatile bool  new_command = FALSE;			// flag that we got a new command
 volatile uint8 flag_receive_ready = 0;		// received complete command flag
 
-// keep the current pose and joint offsets as global variables
-volatile int16 current_pose[NUM_AX12_SERVOS];
-volatile int16 joint_offset[NUM_AX12_SERVOS];
+// keep the current pose and joint offsets as double-buffered global frames
+// producers fill the back frame and then swap the front index (a single byte
+// write, so atomic), consumers always read a complete front frame
+int16 current_pose_frame[2][NUM_AX12_SERVOS];
+int16 joint_offset_frame[2][NUM_AX12_SERVOS];
+volatile uint8 current_pose_front = 0;
+volatile uint8 joint_offset_front = 0;
 // and also the current and next motion pages
 volatile uint8 current_motion_page = 0;
 volatile uint8 next_motion_page = 0;		// next motion page if we got new command
+volatile uint8 next_motion_sequence = 0;	// combo sequence of the C# command
+volatile uint8 command_producer = MAILBOX_OPERATOR;	// mailbox producer of the current command
 volatile uint8 current_step = 0;			// number of the current motion page step
 
 
@@ -119,13 +135,164 @@ static inline void delay_ms(uint16 count) {
 	} 
 }
 
+// state shared by the main loop tasks
+static int obstacle_flag = 0;				// obstacle avoidance state
 
-int main(void)
+
+// balance sensing: read gyro/accelerometer and correct the balance joints
+// (a fall posts a command to the mailbox, low battery raises low_battery_alarm)
+static void task_balance(void)
+{
+	int sensor_flag, sensor_process_flag;
+
+	PROFILE_START(PROFILE_SENSOR_READ);
+	sensor_flag = adc_readSensors();      // takes 0.6ms for gyro/accel and 0.9ms including DMS/ultrasonic (156us per channel)
+	PROFILE_END(PROFILE_SENSOR_READ);
+	if ( sensor_flag == 1 ) {
+		// new sensor data - process
+		PROFILE_START(PROFILE_SENSOR_PROCESS);
+		sensor_process_flag = adc_processSensorData();
+		PROFILE_END(PROFILE_SENSOR_PROCESS);
+#ifdef BALANCE_CORRECTION_STREAM
+		// apply the new joint offsets straight away rather than at the next step
+		// (not after a stop, a goal write would switch the torque back on)
+		if ( sensor_process_flag == 0 && bioloid_command != COMMAND_STOP && motionIsRunning() ) {
+			applyBalanceCorrection();	// sync write to the balance joints only
+		}
+#endif
+	}
+}
+
+// pose output: execute motion steps
+static void task_motion(void)
+{
+	executeMotionSequence();	// takes 2.1ms when executing a step during walking or 3.3ms if unpacking a new motion page
+	latency_poll();				// one servo read while waiting for a command to move the robot
+}
+
+// Returns	(int)	bytes between the end of the heap and the stack
+static int ramHeadroom(void)
+{
+	extern char __heap_start, *__brkval;
+	char top;
+
+	return &top - (__brkval == 0 ? &__heap_start : __brkval);
+}
+
+// emergency stop button and command handling
+// This task is the only consumer of the mailbox and the only writer of the
+// command variables the motion executor works from.
+static void task_command(void)
 {
-	// local variables
-	int	sensor_flag, command_flag, comm_status, sensor_process_flag, obstacle_flag;
-	// TIMING: unsigned long timer1, timer2, timer3, timer4;
+	mailboxCommand command;
+
+	// check if start button has been pressed and we need to do emergency stop
+	if ( start_button_pressed && bioloid_command != COMMAND_STOP )
+	{
+		// disable torque & stop
+		disablePoseTorque();
+		mailbox_post(MAILBOX_SAFETY, COMMAND_STOP, 0, 0);
+		
+		// and reset the start button variable
+		start_button_pressed = FALSE;
+	} else if ( start_button_pressed && bioloid_command == COMMAND_STOP ) {
+		// we are resuming from an emergency stop, restore last command
+		mailbox_post(MAILBOX_SAFETY, last_bioloid_command, next_motion_page, next_motion_sequence);
+		// and reset the start button variable
+		start_button_pressed = FALSE;
+	}
+	// low battery - sit down (posted last, so it replaces a resume)
+	if ( low_battery_alarm ) {
+		low_battery_alarm = FALSE;
+		mailbox_post(MAILBOX_SAFETY, COMMAND_SIT, COMMAND_SIT_MP, 0);
+	}
+	
+	// the most urgent command waiting in the mailbox
+	if ( !mailbox_take(&command) ) {
+		return;
+	}
 	
+	switch ( command.Command )
+	{
+#ifdef MOTION_IMAGE_UPLOAD
+		// motion image upload (blocks the main loop, so only while not walking)
+		case COMMAND_LOAD_IMAGE:
+			if ( walk_getWalkState() == 0 ) {
+				watchdog_stop();
+				motionImageReceive();
+				watchdog_start();
+			} else {
+				printf_P(PSTR("\nLOAD - stop walking first\n> "));
+			}
+			return;
+#else
+		case COMMAND_LOAD_IMAGE:
+			printf_P(PSTR("\nLOAD - not compiled in (MOTION_IMAGE_UPLOAD in global.h)\n> "));
+			return;
+#endif
+		// statistics, the motion carries on
+		case COMMAND_CACHE_STATS:
+			motionCacheReport();
+			return;
+		case COMMAND_PROFILE:
+			profile_report();
+			return;
+		case COMMAND_TASK_STATS:
+			scheduler_report();
+			return;
+		case COMMAND_MAILBOX_STATS:
+			mailbox_report();
+			return;
+		case COMMAND_LATENCY:
+			latency_report();
+			return;
+		case COMMAND_CPU_LOAD:
+			scheduler_loadReport();
+			return;
+		case COMMAND_LIMIT_STATS:
+			poseLimitReport();
+			return;
+		// switch the step timing between as authored and fastest feasible
+		case COMMAND_TIMING_MODE:
+			if ( getPoseTimingMode() == POSE_TIMING_FASTEST ) {
+				setPoseTimingMode(POSE_TIMING_AS_AUTHORED);
+				printf_P(PSTR("\nStep timing as authored\n> "));
+			} else {
+				setPoseTimingMode(POSE_TIMING_FASTEST);
+				printf_P(PSTR("\nStep timing fastest feasible\n> "));
+			}
+			return;
+	}
+	
+	// set the new command global variables
+	last_bioloid_command = bioloid_command;
+	bioloid_command = command.Command;
+	next_motion_page = command.MotionPage;
+	next_motion_sequence = command.Sequence;
+	command_producer = command.Producer;
+	new_command = TRUE;
+	// TEST: printf("\n Command %i, New %i, MP %i, Next MP %i ", bioloid_command, new_command, current_motion_page, next_motion_page);
+}
+
+// operator input: parse a complete command line from the serial port and
+// post it to the mailbox
+static void task_serial(void)
+{
+	serialReceiveCommand();		// takes 4ms if new command (largely because of printf)
+}
+
+// obstacle avoidance for walking
+static void task_obstacle(void)
+{
+	if ( walk_getWalkState() != 0 ) {
+		// currently very basic - turn left until path is clear
+		obstacle_flag = walk_avoidObstacle(obstacle_flag);
+	}
+}
+
+
+int main(void)
+{
 	// Initialization Routines
 	led_init();				// switches all 6 LEDs on
 	serial_init(57600);		// serial port at 57600 baud
@@ -134,13 +301,21 @@ int main(void)
 	delay_ms(200);			// wait 0.2s 
 	led_off(ALL_LED);		// and switch them back off
 	
-	// initialize the clock
+	// initialize the clock and the control tick
 	clock_init();
+	tick_init();
 	
 	// enable interrupts
 	sei();
 	// print welcome message
 	printf("\n C.I.T.I.C. Bioloid C Control V 1\n");
+	// report the crash record if the watchdog restarted us
+	watchdog_init();
+	// the RAM of the compiled in features is fixed by now, check the stack has room
+	printf_P(PSTR("RAM left for the stack %i bytes\n"), ramHeadroom());
+	if ( ramHeadroom() < RAM_MIN_HEADROOM ) {
+		printf_P(PSTR("RAM - below RAM_MIN_HEADROOM (%i bytes)!\n"), RAM_MIN_HEADROOM);
+	}
 	// reset the start button variable, something triggers the interrupt on start-up
 	start_button_pressed = FALSE;
 	
@@ -148,7 +323,8 @@ int main(void)
 	motionPageInit();
 	
 	// Wait for the START Button before going any further
-	while(!start_button_pressed)
+	// (not after a watchdog reset, the robot was already running)
+	while(!start_button_pressed && !watchdog_wasReset())
 	{
 		// PLAY LED is flashing at 5Hz
 		led_toggle(LED_PLAY);
@@ -167,10 +343,11 @@ int main(void)
 	
 	// set the walk state
 	walk_setWalkState(0);
-	obstacle_flag = 0;
 
 	// initialize the ADC and take default readings
-	delay_ms(4000);			// wait 4s for gyros to stabilize
+	if ( !watchdog_wasReset() ) {
+		delay_ms(4000);		// wait 4s for gyros to stabilize (they still are after a watchdog reset)
+	}
 	adc_init();
 
 	// print out default sensor values
@@ -179,76 +356,20 @@ int main(void)
 	// write out the command prompt
 	printf(	"\nListo para Recibir comandos.\n> ");
 
-	// TIMING: timer4 = micros();
-
-	// main command loop (takes 28us when idle)
+	// main command loop, the tasks run to completion by priority and deadline
+	// so a slow page unpack can't hold up balance sensing for longer than one slice
+	scheduler_init();
+	scheduler_addTask(task_balance, SCHEDULER_TICK, BALANCE_TASK_DEADLINE, 0);
+	scheduler_addTask(task_motion, MOTION_TASK_PERIOD, MOTION_TASK_DEADLINE, 1);
+	scheduler_addTask(task_command, COMMAND_TASK_PERIOD, COMMAND_TASK_DEADLINE, 2);
+	scheduler_addTask(task_serial, SERIAL_TASK_PERIOD, SERIAL_TASK_DEADLINE, 3);
+	scheduler_addTask(task_obstacle, OBSTACLE_TASK_PERIOD, OBSTACLE_TASK_DEADLINE, 4);
 	
-	command_flag=0;
-	command_flag = sendCommand("WFWD");	
+	// from now on a hung or starved task resets the controller
+	watchdog_start();
     while(1)
     {
-		// Check if we received a new command
-		//command_flag = serialReceiveCommand();		// takes 4ms if new command (largely because of printf)
-		
-        
-		
-		// TIMING: timer1 = micros() - timer4;
-		
-		// check if start button has been pressed and we need to do emergency stop
-		if ( start_button_pressed && bioloid_command != COMMAND_STOP )
-		{
-			
-			// disable torque & reset current command
-			comm_status = dxl_write_byte(BROADCAST_ID, DXL_TORQUE_ENABLE, 0);
-			last_bioloid_command = bioloid_command;
-			bioloid_command = COMMAND_STOP;
-			command_flag = 1;
-			
-			// and reset the start button variable
-			start_button_pressed = FALSE;
-		} else if ( start_button_pressed && bioloid_command == COMMAND_STOP ) {
-			// we are resuming from an emergency stop, restore last command
-			bioloid_command = last_bioloid_command;
-			last_bioloid_command = COMMAND_STOP;
-			command_flag = 1;
-			// and reset the start button variable
-			start_button_pressed = FALSE;
-		}
-		
-		// Check if we need to read the sensors 
-		sensor_flag = adc_readSensors();      // takes 0.6ms for gyro/accel and 0.9ms including DMS/ultrasonic (156us per channel)
-		if ( sensor_flag == 1 ) {
-			// new sensor data - process and update command flag if necessary
-			sensor_process_flag = adc_processSensorData();
-			if ( command_flag == 0 && sensor_process_flag == 1 ) {
-				command_flag = 1;
-			}
-		}
-		
-		// obstacle avoidance for walking
-		if ( walk_getWalkState() != 0 ) {
-			// currently very basic - turn left until path is clear
-			obstacle_flag = walk_avoidObstacle(obstacle_flag);
-			if ( command_flag == 0 && (obstacle_flag == 1 || obstacle_flag == -1) ) {
-				command_flag = 1;
-			}
-		}
-		
-		// set the new command global variable
-		if( command_flag == 1 ) {
-			new_command = TRUE;
-			command_flag = 0;
-		}
-		// TEST: printf("\n Command %i, New %i, MP %i, Next MP %i ", bioloid_command, new_command, current_motion_page, next_motion_page);
-		
-		// TIMING: timer2 = micros() - timer4 - timer1;
-		
-		// execute motion steps
-		executeMotionSequence();	// takes 2.1ms when executing a step during walking or 3.3ms if unpacking a new motion page
-		
-		// TIMING: timer3 = micros() - timer4 - timer1 - timer2;
-		// TIMING: printf("%lu, %lu, %lu, %i\n", timer1, timer2, timer3, sensor_flag);
-		// TIMING: timer4 = micros();
+		scheduler_dispatch();
 
     } // end of main command loop
 
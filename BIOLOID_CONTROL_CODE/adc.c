@@ -39,7 +39,11 @@
 #include "global.h"
 #include "adc.h"
 #include "clock.h"
+#include "tick.h"
 #include "buzzer.h"
+#include "pose.h"
+#include "mailbox.h"
+#include "scheduler.h"
 
 // Global variables related to the finite state machine that governs execution
 extern volatile uint8 bioloid_command;			// current command
@@ -48,13 +52,12 @@ extern volatile uint8 last_bioloid_command;		// last command
 extern volatile uint8 current_motion_page;
 extern volatile uint8 next_motion_page;	
 extern uint8 current_step;						// number of the current motion page step
-// joint offset values
-extern volatile int16 joint_offset[NUM_AX12_SERVOS];
 
 // global variables used for the ADC values
 extern volatile uint8 adc_sensor_enable[ADC_CHANNELS];  // enabled sensors
 extern volatile int16 adc_sensor_val[ADC_CHANNELS]; 	 // array of sensor values
 extern volatile uint16 adc_battery_val;		 // battery voltage in millivolts
+extern volatile bool low_battery_alarm;		 // task_command posts the safety command
 extern volatile uint16 adc_gyrox_center;	 // gyro x center value
 extern volatile uint16 adc_gyroy_center;	 // gyro x center value
 extern volatile int16 adc_accelx;			 // accelerometer x value
@@ -79,10 +82,23 @@ const uint16 DMSTableValues[DMSTablePoints]=
 const uint16 DMSTableCM[DMSTablePoints]=
 {80, 70, 60, 50, 40, 30, 25, 20, 15, 10, 5};
 
+// Index (into AX12_IDS) of the joints that receive gyro balance offsets
+// in the order knees, ankles (fwd/bwd), hips, ankles (left/right)
+// this is dependent on the hardware configuration (see adc_processSensorData)
+#ifdef HUMANOID_TYPEA	// Type A - all 18 servos are present and numbers match
+const uint8 adc_balance_joints[NUM_BALANCE_JOINTS] = {13-1, 14-1, 15-1, 16-1, 9-1, 10-1, 17-1, 18-1};
+#endif
+#ifdef HUMANOID_TYPEB	// Type B - 16 servos and 9 and 10 are missing
+const uint8 adc_balance_joints[NUM_BALANCE_JOINTS] = {13-3, 14-3, 15-3, 16-3, 17-3, 18-3};
+#endif
+#ifdef HUMANOID_TYPEC	// Type C - 16 servos and 7 and 8 are missing
+const uint8 adc_balance_joints[NUM_BALANCE_JOINTS] = {13-3, 14-3, 15-3, 16-3, 9-3, 10-3, 17-3, 18-3};
+#endif
+
 // internal timing related variables that control when the sensors are read
-unsigned long last_gyro_read = 0;
-unsigned long last_dms_read = 0;
-unsigned long last_battery_read = 0;
+uint16 last_gyro_tick = 0;
+uint8 dms_timer = 0;						// scheduler timers of the slow sensors
+uint8 battery_timer = 0;
 
 
 // function to process the sensor data when new data become available
@@ -93,14 +109,13 @@ unsigned long last_battery_read = 0;
 int adc_processSensorData()
 {
 	int16 fb_joint_offset1, fb_joint_offset2, rl_joint_offset0, rl_joint_offset1;
+	int16 *joint_offset;
 
 	// check battery voltage still within limits
 	if ( adc_battery_val < LOW_VOLTAGE_CUTOFF ) {
 		// too low - play alarm and stop 
 		buzzer_playFromProgramSpace(melody5);
-		last_bioloid_command = bioloid_command;
-		bioloid_command = COMMAND_SIT;
-		next_motion_page = COMMAND_SIT_MP;
+		low_battery_alarm = TRUE;
 		return 1;
 	}
 	
@@ -119,16 +134,12 @@ int adc_processSensorData()
 	// did read sensors - check if robot slipped
 	if( fwd_bwd_balance > GYROX_SLIP_ERROR ) {
 		// backward slip
-		last_bioloid_command = bioloid_command;
-		bioloid_command = COMMAND_BACK_GET_UP;
-		next_motion_page = COMMAND_BACK_GET_UP_MP;
+		mailbox_post(MAILBOX_RECOVERY, COMMAND_BACK_GET_UP, COMMAND_BACK_GET_UP_MP, 0);
 		return 1;
 	}
 	else if( fwd_bwd_balance < -GYROX_SLIP_ERROR ) {
 		// forward slip
-		last_bioloid_command = bioloid_command;
-		bioloid_command = COMMAND_FRONT_GET_UP;
-		next_motion_page = COMMAND_FRONT_GET_UP_MP;
+		mailbox_post(MAILBOX_RECOVERY, COMMAND_FRONT_GET_UP, COMMAND_FRONT_GET_UP_MP, 0);
 		return 1;
 	}
 	
@@ -140,6 +151,8 @@ int adc_processSensorData()
 	
 	// TEST: printf("\nOffsets FB = %i, %i, RL= %i, %i", fb_joint_offset1, fb_joint_offset2, rl_joint_offset0, rl_joint_offset1);
 	
+	// fill the back offset frame, consumers keep seeing the previous offsets
+	joint_offset = getJointOffsetBackFrame();
 	// just in case reset all offset values
 	for (uint8 i=0; i<NUM_AX12_SERVOS; i++) {
 		joint_offset[i] = 0;
@@ -173,27 +186,29 @@ int adc_processSensorData()
 	joint_offset[17-3] = -rl_joint_offset0;
 	joint_offset[18-3] = -rl_joint_offset0;
 #endif
+	// and swap in the complete frame
+	publishJointOffsets();
 
 	return 0;
 }
 
 // function that reads all the sensors from the main loop
-// SENSOR_READ_INTERVAL in global.h determines how often the sensors are read
-// BATTERY_READ_INTERVAL in global.h determines how often the battery voltage is read
+// the gyro and accelerometer are read once per control tick, DMS_READ_INTERVAL
+// and BATTERY_READ_INTERVAL in global.h set the scheduler timers of the others
 // Returns:  int flag = 0 when no new values have been read
 //           int flag = 1 when new values have been read
 int adc_readSensors()    
 {
+	uint16 tick = tick_getCount();
+
 	// reading the battery has no impact on return value, so done first
-	if( (millis() - last_battery_read) >= BATTERY_READ_INTERVAL ) 	
+	if( scheduler_timerExpired(battery_timer) ) 	
 	{
 		adc_battery_val = adc_readBatteryMillivolts();
-		// reset the timing variable
-		last_battery_read = millis();
 	}
 
-	// check if we are overdue for reading the sensors
-	if( (millis() - last_gyro_read) >= GYRO_READ_INTERVAL ) 
+	// read the sensors once per control tick, so the gyro sample period is fixed
+	if( tick != last_gyro_tick ) 
 	{
 		// read each sensor in sequence
 		// single conversion time is around 120us
@@ -214,7 +229,7 @@ int adc_readSensors()
 			adc_sensor_val[ADC_ACCELY-1] = adc_readMillivolts(ADC_ACCELY);
 		}
 		// only read distance sensors if they are due
-		if( (millis() - last_dms_read) >= DMS_READ_INTERVAL )
+		if( scheduler_timerExpired(dms_timer) )
 		{
 			if (adc_sensor_enable[ADC_DMS-1] == 1)
 			{
@@ -224,10 +239,9 @@ int adc_readSensors()
 			{
 				adc_sensor_val[ADC_ULTRASONIC-1] = adc_readMillivolts(ADC_ULTRASONIC);  
 			}
-			last_dms_read = millis();
 		}		
 		// reset the timing variable
-		last_gyro_read = millis();
+		last_gyro_tick = tick;
 		return 1;
 	}
 	
@@ -248,8 +262,9 @@ void adc_init()
 	// now check the battery voltage
 	adc_battery_val = adc_readBatteryMillivolts();
 	
-	// and set the timing variables
-	last_battery_read = millis();
+	// and set the timers of the slow sensors
+	battery_timer = scheduler_addTimer(BATTERY_READ_INTERVAL);
+	dms_timer = scheduler_addTimer(DMS_READ_INTERVAL);
 
 	// finally we need to find initial gyro and accelerometer center positions
 	adc_gyrox_center = 0;
@@ -285,7 +300,7 @@ void adc_init()
 	adc_accely_center = adc_accely_center / 16;
 	
 	// and set the timing variables
-	last_gyro_read = millis();
+	last_gyro_tick = tick_getCount();
 }
 
 // set the ADC to run in either 8-bit mode (MODE_8_BIT) or 
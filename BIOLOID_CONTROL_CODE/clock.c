@@ -1,5 +1,5 @@
 /*
- * clock.c - millisecond and microsecond clock
+ * clock.c - timestamp, millisecond and microsecond clock from TIMER4
  * 
  * Version 0.4		30/09/2011
  * Written by Peter Lanius
@@ -20,30 +20,33 @@
 
 #include "clock.h"
 
-// The prescaler is set so that TIMER0 ticks every 64 clock cycles, and the
-// the overflow handler is called every 256 ticks.
-#define MICROSECONDS_PER_TIMER0_OVERFLOW (clockCyclesToMicroseconds(64 * 256))
+// TIMER4 counts at F_CPU/8 (2MHz at 16MHz) and the overflow handler is called
+// every 65536 counts (32.768ms). The overflows extend the count to 32 bits.
+#define MICROSECONDS_PER_TIMER4_OVERFLOW (65536L / CLOCK_COUNTS_PER_US)
 
-// The whole number of milliseconds per TIMER0 overflow
-#define MILLIS_INC (MICROSECONDS_PER_TIMER0_OVERFLOW / 1000)
+// The whole number of milliseconds per TIMER4 overflow
+#define MILLIS_INC (MICROSECONDS_PER_TIMER4_OVERFLOW / 1000)
 
-// The fractional number of milliseconds per TIMER0 overflow. We shift right
-// by three to fit these numbers into a byte. (for the clock speeds we care
-// about - 8 and 16 MHz - this doesn't lose precision.)
-#define FRACT_INC ((MICROSECONDS_PER_TIMER0_OVERFLOW % 1000) >> 3)
-#define FRACT_MAX (1000 >> 3)
+// The microseconds left over per TIMER4 overflow
+#define FRACT_INC (MICROSECONDS_PER_TIMER4_OVERFLOW % 1000)
+#define FRACT_MAX 1000
 
-volatile unsigned long timer0_overflow_count = 0;
-volatile unsigned long timer0_millis = 0;
-static unsigned char timer0_fract = 0;
+// Two reads of TCNT4 further apart than this (in counts) are read again. An
+// interrupt that touches another 16 bit timer register between the low and
+// high byte of the read corrupts the shared TEMP register.
+#define CLOCK_READ_WINDOW 64
 
-// TIMER0 overflow interrupt is triggered every 1024us at 16MHz
-ISR (TIMER0_OVF_vect)
+volatile unsigned long timer4_overflow_count = 0;
+volatile unsigned long timer4_millis = 0;
+volatile uint16 timer4_fract = 0;
+
+// TIMER4 overflow interrupt is triggered every 32.768ms at 16MHz
+ISR (TIMER4_OVF_vect)
 {
    // copy these to local variables so they can be stored in registers
    // (volatile variables must be read from memory on every access)
-   unsigned long m = timer0_millis;
-   unsigned char f = timer0_fract;
+   unsigned long m = timer4_millis;
+   uint16 f = timer4_fract;
 
    m += MILLIS_INC;
    f += FRACT_INC;
@@ -52,73 +55,87 @@ ISR (TIMER0_OVF_vect)
       m += 1;
    }
 
-   timer0_fract = f;
-   timer0_millis = m;
-   timer0_overflow_count++;
+   timer4_fract = f;
+   timer4_millis = m;
+   timer4_overflow_count++;
+}
+
+// take a consistent snapshot of the clock without masking interrupts
+// The overflow count is read before and after the timer, if the overflow
+// interrupt came in between everything is read again. An overflow that is
+// still pending (called with interrupts off) is added by hand.
+static inline void clockSnapshot(unsigned long *overflows, uint16 *count, unsigned long *ms, uint16 *fract)
+{
+	unsigned long o, m;
+	uint16 f, t, t2;
+	uint8 pending;
+
+	do {
+		o = timer4_overflow_count;
+		m = timer4_millis;
+		f = timer4_fract;
+		t = TCNT4;
+		pending = TIFR4 & _BV(TOV4);
+		t2 = TCNT4;
+	} while( o != timer4_overflow_count || (uint16) (t2 - t) > CLOCK_READ_WINDOW );
+
+	// the timer wrapped before we read it, but the interrupt hasn't run yet
+	if( pending && t < 0x8000 ) {
+		o++;
+		m += MILLIS_INC;
+		f += FRACT_INC;
+		if( f >= FRACT_MAX ) {
+			f -= FRACT_MAX;
+			m += 1;
+		}
+	}
+	*overflows = o;
+	*count = t;
+	*ms = m;
+	*fract = f;
+}
+
+// return the 32 bit timestamp in TIMER4 counts (CLOCK_COUNTS_PER_US per us)
+uint32 clock_timestamp(void)
+{
+	unsigned long o, m;
+	uint16 t, f;
+
+	clockSnapshot(&o, &t, &m, &f);
+	return (o << 16) | t;
 }
 
 // return the current millisecond count
 unsigned long millis()
 {
-	unsigned long m;
-
-	// disable interrupt while we read timer0_millis or we might get an
-	// inconsistent value (e.g. in the middle of a write to timer0_millis)
-	DISABLE_TIMER0_INTERRUPT();
-	m = timer0_millis;
-	
-	// re-enable TIMER0 overflow interrupt
-	ENABLE_TIMER0_INTERRUPT();
-	
-	// there is a small chance an overflow occurred when interrupt was disabled
-	if ( TIFR0 & _BV(TOV0) ) 
-	{
-		// this should be safe since we have nearly 1ms left until the next overflow
-		m++;
-		timer0_millis++;
-		bit_set_hi(TIFR0,TOV0); // clear the overflow flag since the interrupt didn't execute
-	}	
-
-	return m;
+	unsigned long o, m;
+	uint16 t, f;
+
+	clockSnapshot(&o, &t, &m, &f);
+	return m + (f + t / CLOCK_COUNTS_PER_US) / 1000;
 }
 
-// return current microsecond count by reading TIMER0 value directly
+// return current microsecond count
 unsigned long micros() 
 {
-	unsigned long m;
-	uint8 t;
-
-	// disable interrupts and read the timer
-	DISABLE_TIMER0_INTERRUPT();
-	m = timer0_overflow_count;
-	t = TCNT0;
-  
-	// re-enable interrupts
-	ENABLE_TIMER0_INTERRUPT();
-   
-	// there is a small chance an overflow occurred when interrupt was disabled
-	if ((TIFR0 & _BV(TOV0)) && (t < 255))
-	{
-		// this should be safe since we have nearly 1ms until the next overflow
-		m++;
-		timer0_millis++;
-		bit_set_hi(TIFR0,TOV0); // clear the overflow flag since the interrupt didn't execute
-	}	
-
-	return ((m << 8) + t) * (64 / clockCyclesPerMicrosecond());
+	unsigned long o, m;
+	uint16 t, f;
+
+	clockSnapshot(&o, &t, &m, &f);
+	return (o * MICROSECONDS_PER_TIMER4_OVERFLOW) + t / CLOCK_COUNTS_PER_US;
 }
 
-// initializes the TIMER0 which we use for the clock
+// initializes the TIMER4 which we use for the clock
 void clock_init()
 {
-	// TIMER0 is an 8-bit timer which we set up in fast PWM mode
-	bit_set_hi(TCCR0A, WGM01);
-	bit_set_hi(TCCR0A, WGM00);
+	// TIMER4 is a 16-bit timer which we run in normal mode (counts up to 0xFFFF)
+	TCCR4A = 0;
+	TCCR4B = 0;
+	TCNT4 = 0;
 
-	// set TIMER0 prescale factor to 64 = 250kHz
-	bit_set_hi(TCCR0B, CS01);
-	bit_set_hi(TCCR0B, CS00);
+	// set TIMER4 prescale factor to 8 = 2MHz
+	bit_set_hi(TCCR4B, CS41);
 
-	// enable TIMER0 overflow interrupt
-	bit_set_hi(TIMSK0, TOIE0);
-}
\ No newline at end of file
+	// enable TIMER4 overflow interrupt
+	bit_set_hi(TIMSK4, TOIE4);
+}
@@ -1,5 +1,5 @@
 /*
- * clock.h - millisecond and microsecond clock
+ * clock.h - timestamp, millisecond and microsecond clock from TIMER4
  * 
  * Version 0.4		30/09/2011
  * Written by Peter Lanius
@@ -32,18 +32,17 @@
 extern "C"{
 #endif
 
-// Interrupt enable/disable macros
-#define ENABLE_TIMER0_INTERRUPT()	TIMSK0 = (1<<TOIE0)
-#define DISABLE_TIMER0_INTERRUPT()	TIMSK0 = 0
-
-// macros for conversions between F_CPU and microseconds
-#define clockCyclesPerMicrosecond()  ( F_CPU / 1000000L )
-#define clockCyclesToMicroseconds(a) ( (a) / clockCyclesPerMicrosecond() )
-#define microsecondsToClockCycles(a) ( (a) * clockCyclesPerMicrosecond() )
+// TIMER4 runs at F_CPU/8, so one count of the timestamp is 0.5us at 16MHz
+#define CLOCK_PRESCALE				8
+#define CLOCK_COUNTS_PER_US			( F_CPU / 1000000L / CLOCK_PRESCALE )
 
 // initialize the clock functions
 void clock_init(void);
 
+// return the 32 bit timestamp in TIMER4 counts (CLOCK_COUNTS_PER_US per us),
+// wraps around after 35 minutes
+uint32 clock_timestamp(void);
+
 // return millisecond count
 unsigned long millis(void);
 
@@ -636,8 +636,7 @@ int dxl_sync_write_word( int NUM_ACTUATOR, int address, const uint8 ids[], int16
 		return 0;
 	} else if (NUM_ACTUATOR == 1) {
 		// easy, we can use dxl_write_word for a single actuator
-		dxl_write_word( ids[0], address, values[0] );
-		return 0;
+		return dxl_write_word( ids[0], address, values[0] );
 	}
 	
 	// Multiple values, create sync write packet
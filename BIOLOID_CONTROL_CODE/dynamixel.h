@@ -211,7 +211,7 @@ void dxl_printCommStatus(int CommStatus);
 // ParameterL+6 The 2nd data for the 2nd Dynamixel actuator
 // 
 // NOTE: this function only allows 2 bytes of data per actuator
-int dxl_sync_write_word( int NUM_ACTUATOR, int address, const uint8 ids[], int values[] );
+int dxl_sync_write_word( int NUM_ACTUATOR, int address, const uint8 ids[], int16 values[] );
 
 // Function setting goal and speed for all Dynamixel actuators at the same time  
 // Uses the Sync Write instruction (also see dxl_sync_write_word) 
@@ -43,17 +43,21 @@ extern "C" {
 // Robot specific definitions:
 // Number of Dynamixel actuators (see also main program for ID's)
 // Number of motion pages in the motion file (and motion.h)
+// Number of joints receiving gyro balance offsets (knees, ankles, hips - see adc.c)
 #ifdef HUMANOID_TYPEA
 	#define NUM_AX12_SERVOS		18
 	#define	NUM_MOTION_PAGES	225 
+	#define NUM_BALANCE_JOINTS	8
 #endif
 #ifdef HUMANOID_TYPEB
 	#define NUM_AX12_SERVOS		16
 	#define	NUM_MOTION_PAGES	227
+	#define NUM_BALANCE_JOINTS	6
 #endif
 #ifdef HUMANOID_TYPEC
 	#define NUM_AX12_SERVOS		16
 	#define	NUM_MOTION_PAGES	227
+	#define NUM_BALANCE_JOINTS	8
 #endif
 
 // Dynamixel configuration definitions 
@@ -61,13 +65,59 @@ extern "C" {
 #define MAX_MOTION_STEPS	7
 
 // Top level ADC/Sensor related parameters - adjust as needed
-#define GYRO_READ_INTERVAL		16		// read gyro every 16ms 
-#define DMS_READ_INTERVAL		500		// read DMS every 500ms
-#define BATTERY_READ_INTERVAL	1000	// read battery once every second
+#define CONTROL_TICK_RATE		125		// control ticks per second (TIMER3), gyro is read every tick
+#define DMS_READ_INTERVAL		500		// read DMS every 500ms (scheduler timer)
+#define BATTERY_READ_INTERVAL	1000	// read battery once every second (scheduler timer)
 #define GYROX_SLIP_ERROR		170		// deviation from 0 interpreted as a slip (170 = 250deg/s rotation)
 #define LOW_VOLTAGE_CUTOFF		10500	// 10.5V is a very safe limit for a 11.7V LiPo
 #define SAFE_DISTANCE			50		// minimum distance from obstacles to stop avoiding (cm)
 #define MINIMUM_DISTANCE		20		// minimum distance from obstacles to start avoiding (cm)
+// Stream gyro corrections to the balance joints after every gyro read (comment out to
+// apply the joint offsets only at the start of each motion step as before)
+#define BALANCE_CORRECTION_STREAM
+// Accept motion images uploaded with the LOAD command (see motion_image.h and Readme.md).
+// Off by default: Flash can only be written from the boot section, so it has to be
+// linked with -Wl,--section-start=.bootloader=0x3E000, which overwrites the Robotis
+// bootloader - from then on the board can only be programmed with an ISP. Without
+// the linker option every upload fails its read back check. Also link motion_image.ld,
+// it stops the link if the application grows into the image slots.
+// #define MOTION_IMAGE_UPLOAD
+// Keep the pages of a NextPage cycle (walk pages) decoded in RAM, so a steady walk
+// doesn't unpack pages from Flash (size in bytes). Off by default, the 8KB RAM is
+// tight with the prefetch buffer, the pose frames and the statistics tables; check
+// the headroom reported at boot after enabling it.
+// #define MOTION_PAGE_CACHE		1536
+#define MOTION_CACHE_PAGES		12		// longest cycle that is cached (one walk block)
+// RAM left for the stack between the end of the heap and the stack pointer in main,
+// the boot message warns below this (deepest call chain plus the interrupts)
+#define RAM_MIN_HEADROOM		1024
+// Time the hot path regions (sensor read, step, page unpack, sync write, ...), the
+// PROF command prints the statistics (comment out to compile the profiling out)
+#define PROFILER
+// Command to motion latency tracing of operator commands (LATY command)
+#define LATENCY_SAMPLES			16		// percentiles are over the last 16 commands of a type
+#define LATENCY_MOVE_TIMEOUT	1000	// ms to wait for the first servo movement
+// Main loop tasks (see scheduler.c), period and deadline in ms. Balance sensing has
+// the highest priority and runs every control tick, pose output polls the end of
+// the current step every 1ms, the serial port is polled for operator commands.
+// Every task is also a watchdog heartbeat.
+#define MAX_SCHEDULER_TASKS		6		// at most 8 (watchdog heartbeat mask)
+#define MAX_SCHEDULER_TIMERS	4		// interval timers (DMS and battery reads)
+#define BALANCE_TASK_DEADLINE	5		// a motion slice (page unpack) takes up to 3.3ms
+#define MOTION_TASK_PERIOD		1
+#define MOTION_TASK_DEADLINE	3
+#define COMMAND_TASK_PERIOD		5
+#define COMMAND_TASK_DEADLINE	5
+#define SERIAL_TASK_PERIOD		10		// a command line at 57600 baud takes about 1ms
+#define SERIAL_TASK_DEADLINE	10		// parsing and echoing a command takes up to 4ms
+#define OBSTACLE_TASK_PERIOD	50
+#define OBSTACLE_TASK_DEADLINE	50
+// Hardware watchdog, reset when a task hangs or is starved for longer than this
+// (avr/wdt.h timeout), the crash record is printed at the next boot
+#define WATCHDOG_TIMEOUT		WDTO_1S
+// CPU load accounting of the scheduler (CPU command)
+#define LOAD_WINDOW				1000	// ms per load window
+#define LOAD_HISTORY			10		// the worst window of the last 10 is reported
 
 // Command List
 // To add commands:		1. Add it to the list below
@@ -75,7 +125,7 @@ extern "C" {
 //						3. If required, add a motion page associated with the command below
 //						4. Edit serial.c and update the command string list
 //						5. Edit serial.c and update SerialReceiveCommand()
-#define NUMBER_OF_COMMANDS				25	// how many commands we recognize
+#define NUMBER_OF_COMMANDS				35	// how many commands we recognize
 #define COMMAND_STOP					0
 #define COMMAND_WALK_FORWARD			1
 #define COMMAND_WALK_BACKWARD			2
@@ -101,8 +151,23 @@ extern "C" {
 #define COMMAND_FRONT_GET_UP			22
 #define COMMAND_BACK_GET_UP				23
 #define COMMAND_RESET					24
+#define COMMAND_LOAD_IMAGE				25
+#define COMMAND_SEQUENCE				26
+#define COMMAND_CACHE_STATS				27
+#define COMMAND_PROFILE					28
+#define COMMAND_TASK_STATS				29
+#define COMMAND_MAILBOX_STATS			30
+#define COMMAND_LATENCY					31
+#define COMMAND_CPU_LOAD				32
+#define COMMAND_TIMING_MODE				33
+#define COMMAND_LIMIT_STATS				34
 #define COMMAND_NOT_FOUND				255
 
+// Commands that only print statistics or switch a setting, the robot carries
+// on with what it is doing. They go from COMMAND_CACHE_STATS to the end of the
+// list, add new commands that don't move the robot at the end.
+#define COMMAND_IS_REPORT(command)	((command) >= COMMAND_CACHE_STATS && (command) < NUMBER_OF_COMMANDS)
+
 // Motion Pages associated with non-walking commands
 // these are the same for all 3 HUMANOID Robot Types
 #define COMMAND_WALK_READY_MP			31
@@ -112,6 +177,24 @@ extern "C" {
 #define COMMAND_FRONT_GET_UP_MP			27
 #define COMMAND_BACK_GET_UP_MP			28
 #define COMMAND_RESET_MP				26
+// the walk command motion pages are in sequence and 12 pages apart each
+#define WALK_COMMAND_MP(command)		(12*((command)-1) + COMMAND_WALK_READY_MP + 1)
+
+// Combo sequences (C# command, see motion_sequence.c)
+// The pages of the example combo - adjust them to your motion file, a sequence
+// with a page that does not exist is rejected when the command is received
+#define MAX_SEQUENCE_ENTRIES			8	// motion pages per sequence
+#define COMBO_GUARD_MP					COMMAND_BALANCE_MP
+#define COMBO_JAB_MP					1
+#define COMBO_RETREAT_MP				2
+#define COMBO_REACH						15	// DMS distance in cm that counts as within reach
+
+// Motion page preemption (see MOTION_PREEMPT_POLICY in motion_f.c)
+// Commands of this mailbox producer and the more urgent ones may cut a page short
+// at a step boundary if the policy of the page allows it (2 = MAILBOX_OPERATOR)
+#define MOTION_PREEMPT_PRODUCER			2
+#define ACTION_FIRST_MP					1	// action (fight) pages of the motion file
+#define ACTION_LAST_MP					24
 
 
 // Standard types
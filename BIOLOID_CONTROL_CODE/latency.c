@@ -0,0 +1,171 @@
+/*
+ * latency.c - command to motion latency tracing, from the serial receive
+ *	interrupt to the first servo movement, with rolling percentiles
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <avr/pgmspace.h>
+#include "global.h"
+#include "latency.h"
+#include "clock.h"
+#include "dynamixel.h"
+#include "pose.h"
+
+// samples are kept in units of 64 timestamp counts (32us at 16MHz), so
+// they fit 16 bits up to 2 seconds
+#define LATENCY_SHIFT			6
+
+// trace states
+#define TRACE_IDLE				0
+#define TRACE_WRITE				1		// waiting for the first sync write
+#define TRACE_MOVE				2		// waiting for the first movement
+
+extern const uint8 AX12_IDS[NUM_AX12_SERVOS];
+
+// the last LATENCY_SAMPLES samples per type and stage (ring buffers)
+static uint16 latency_samples[LATENCY_TYPES][LATENCY_STAGES][LATENCY_SAMPLES];
+static uint8 latency_next[LATENCY_TYPES][LATENCY_STAGES];
+static uint8 latency_count[LATENCY_TYPES][LATENCY_STAGES];
+
+// the command being traced
+static uint8 trace_state = TRACE_IDLE;
+static uint8 trace_type;
+static uint8 trace_servo;				// servo watched for the first movement
+static uint32 trace_received;			// timestamp of the receive interrupt
+
+const char LATENCYTYPE0[] PROGMEM = "walk";
+const char LATENCYTYPE1[] PROGMEM = "page";
+const char LATENCYTYPE2[] PROGMEM = "sequence";
+PGM_P LATENCYTYPE_POINTER[] PROGMEM = {
+LATENCYTYPE0, LATENCYTYPE1, LATENCYTYPE2 };
+const char LATENCYSTAGE0[] PROGMEM = "parse";
+const char LATENCYSTAGE1[] PROGMEM = "select";
+const char LATENCYSTAGE2[] PROGMEM = "write";
+const char LATENCYSTAGE3[] PROGMEM = "move";
+PGM_P LATENCYSTAGE_POINTER[] PROGMEM = {
+LATENCYSTAGE0, LATENCYSTAGE1, LATENCYSTAGE2, LATENCYSTAGE3 };
+
+// add the time from the receive interrupt to the stage to the statistics
+static void recordStage(uint8 stage, uint32 time)
+{
+	uint32 latency = (time - trace_received) >> LATENCY_SHIFT;
+	uint8 *next = &latency_next[trace_type][stage];
+
+	latency_samples[trace_type][stage][*next] = (latency > 0xFFFF) ? 0xFFFF : latency;
+	*next = (*next + 1) % LATENCY_SAMPLES;
+	if( latency_count[trace_type][stage] < LATENCY_SAMPLES ) {
+		latency_count[trace_type][stage]++;
+	}
+}
+
+// the motion executor has started on an operator command, trace it
+void latency_commandStarted(const mailboxCommand *command)
+{
+	if( command->Producer != MAILBOX_OPERATOR ) {
+		return;
+	}
+	if( command->Command >= COMMAND_WALK_FORWARD && command->Command <= COMMAND_WALK_BWD_TURN_RIGHT ) {
+		trace_type = LATENCY_WALK;
+	} else if( command->Command == COMMAND_SEQUENCE ) {
+		trace_type = LATENCY_SEQUENCE;
+	} else if( command->Command != COMMAND_STOP && command->Command != COMMAND_NOT_FOUND ) {
+		trace_type = LATENCY_PAGE;
+	} else {
+		trace_state = TRACE_IDLE;
+		return;
+	}
+	trace_received = command->Received;
+	recordStage(LATENCY_PARSE, command->Posted);
+	recordStage(LATENCY_SELECT, clock_timestamp());
+	trace_state = TRACE_WRITE;
+}
+
+// a goal pose has been written to the servos
+void latency_poseWritten(void)
+{
+	if( trace_state != TRACE_WRITE ) {
+		return;
+	}
+	recordStage(LATENCY_WRITE, clock_timestamp());
+	// the joint with the most travel is the first to show a speed
+	trace_servo = AX12_IDS[getPoseBottleneckJoint()];
+	trace_state = TRACE_MOVE;
+}
+
+// watch for the first movement of a traced command (called every motion slice)
+// Costs one servo read per call while waiting, a servo that hasn't moved
+// after LATENCY_MOVE_TIMEOUT ends the trace without a move sample.
+void latency_poll(void)
+{
+	uint32 now;
+	int speed;
+
+	if( trace_state != TRACE_MOVE ) {
+		return;
+	}
+	now = clock_timestamp();
+	speed = dxl_read_word(trace_servo, DXL_PRESENT_SPEED_L);
+	// bit 10 is the direction
+	if( dxl_get_result() == COMM_RXSUCCESS && (speed & 0x03FF) != 0 ) {
+		recordStage(LATENCY_MOVE, now);
+		trace_state = TRACE_IDLE;
+	} else if( now - trace_received > (uint32) LATENCY_MOVE_TIMEOUT * 1000 * CLOCK_COUNTS_PER_US ) {
+		trace_state = TRACE_IDLE;
+	}
+}
+
+// print a sample as ms with one decimal (rounded)
+static void printSample(uint16 sample)
+{
+	uint32 tenths = (((uint32) sample << LATENCY_SHIFT) + CLOCK_COUNTS_PER_US * 50L) / (CLOCK_COUNTS_PER_US * 100L);
+
+	printf_P(PSTR(" %5lu.%lu"), (unsigned long) (tenths / 10), (unsigned long) (tenths % 10));
+}
+
+// print the percentiles of the last LATENCY_SAMPLES commands per type and stage
+void latency_report(void)
+{
+	char type_name[10], stage_name[8];
+	uint16 sorted[LATENCY_SAMPLES], sample;
+	uint8 type, stage, count, i, j;
+
+	printf_P(PSTR("\nLatency (ms from RX)  count    p50    p90    max\n"));
+	for (type=0; type<LATENCY_TYPES; type++)
+	{
+		strcpy_P(type_name, (PGM_P)pgm_read_word(&(LATENCYTYPE_POINTER[type])));
+		for (stage=0; stage<LATENCY_STAGES; stage++)
+		{
+			strcpy_P(stage_name, (PGM_P)pgm_read_word(&(LATENCYSTAGE_POINTER[stage])));
+			count = latency_count[type][stage];
+			printf_P(PSTR("%-9s %-7s  %8i"), type_name, stage_name, count);
+			if( count > 0 ) {
+				// insertion sort of the samples in the ring
+				for (i=0; i<count; i++) {
+					sample = latency_samples[type][stage][i];
+					for (j=i; j>0 && sorted[j-1] > sample; j--) {
+						sorted[j] = sorted[j-1];
+					}
+					sorted[j] = sample;
+				}
+				printSample(sorted[(count-1) * 50 / 100]);
+				printSample(sorted[(count-1) * 90 / 100]);
+				printSample(sorted[count-1]);
+			}
+			printf_P(PSTR("\n"));
+		}
+	}
+	printf_P(PSTR("> "));
+}
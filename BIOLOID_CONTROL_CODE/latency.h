@@ -0,0 +1,52 @@
+/*
+ * latency.h - command to motion latency tracing, from the serial receive
+ *	interrupt to the first servo movement, with rolling percentiles
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include "global.h"
+#include "mailbox.h"
+
+// command types with their own statistics
+#define LATENCY_WALK			0		// walk commands
+#define LATENCY_PAGE			1		// commands that play a motion page (incl. M#)
+#define LATENCY_SEQUENCE		2		// combo sequences (C#)
+#define LATENCY_TYPES			3
+
+// stages of a command, all measured from the end of the command line in the
+// USART1 receive interrupt
+#define LATENCY_PARSE			0		// command parsed and posted to the mailbox
+#define LATENCY_SELECT			1		// motion executor starts on the command
+#define LATENCY_WRITE			2		// first goal sync write of the command
+#define LATENCY_MOVE			3		// first non-zero present speed
+#define LATENCY_STAGES			4
+
+// the motion executor has started on an operator command, trace it
+void latency_commandStarted(const mailboxCommand *command);
+
+// a goal pose has been written to the servos
+void latency_poseWritten(void);
+
+// watch for the first movement of a traced command (called every motion slice)
+void latency_poll(void);
+
+// print the percentiles of the last LATENCY_SAMPLES commands per type and stage
+void latency_report(void);
+
+#endif /* LATENCY_H_ */
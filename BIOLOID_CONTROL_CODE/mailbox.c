@@ -0,0 +1,190 @@
+/*
+ * mailbox.c - command mailbox between the command producers (buttons,
+ *	sensors, serial port, obstacle avoidance) and the motion executor
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <avr/pgmspace.h>
+#include "global.h"
+#include "mailbox.h"
+#include "clock.h"
+#include "latency.h"
+
+// One slot per producer. The producer makes Written odd while it fills in
+// the command and even again when it is done (single byte writes, so no
+// locking is needed even if the producer is an ISR). The slot holds a new
+// command while Written differs from Taken, which only the consumer writes.
+typedef struct
+{
+	volatile uint8 Written;
+	uint8 Taken;
+	mailboxCommand Command;
+} mailboxSlot;
+
+static mailboxSlot mailbox_slots[MAILBOX_PRODUCERS];
+
+// post to execution latency per producer in timestamp counts
+static uint16 mailbox_executed_count[MAILBOX_PRODUCERS];
+static uint32 mailbox_latency_total[MAILBOX_PRODUCERS];
+static uint32 mailbox_latency_max[MAILBOX_PRODUCERS];
+static uint16 mailbox_dropped[MAILBOX_PRODUCERS];
+
+// the command taken last, until the motion executor starts on it
+static mailboxCommand mailbox_last;
+static bool mailbox_last_valid = FALSE;
+
+const char MAILBOXNAME0[] PROGMEM = "safety";
+const char MAILBOXNAME1[] PROGMEM = "recovery";
+const char MAILBOXNAME2[] PROGMEM = "operator";
+const char MAILBOXNAME3[] PROGMEM = "autonomy";
+PGM_P MAILBOXNAME_POINTER[] PROGMEM = {
+MAILBOXNAME0, MAILBOXNAME1, MAILBOXNAME2, MAILBOXNAME3 };
+
+// post a command, only ever called by the owner of the slot
+void mailbox_post(uint8 producer, uint8 command, uint8 page, uint8 sequence)
+{
+	mailbox_postReceived(producer, command, page, sequence, clock_timestamp());
+}
+
+// post a command that came in earlier (received is its clock_timestamp())
+void mailbox_postReceived(uint8 producer, uint8 command, uint8 page, uint8 sequence, uint32 received)
+{
+	mailboxSlot *slot = &mailbox_slots[producer];
+
+	slot->Written++;		// odd - the consumer keeps away
+	slot->Command.Command = command;
+	slot->Command.MotionPage = page;
+	slot->Command.Sequence = sequence;
+	slot->Command.Producer = producer;
+	slot->Command.Received = received;
+	slot->Command.Posted = clock_timestamp();
+	slot->Written++;		// even - complete
+}
+
+// copy the command out of a slot if there is a new one
+// Returns	(bool)	TRUE if the slot had a new command
+static bool readSlot(mailboxSlot *slot, mailboxCommand *command)
+{
+	uint8 written;
+
+	do {
+		written = slot->Written;
+		if( written == slot->Taken || (written & 1) != 0 ) {
+			// nothing new, or the producer is still writing (it got
+			// interrupted by us, we pick the command up next time)
+			return FALSE;
+		}
+		*command = slot->Command;
+	} while( slot->Written != written );
+
+	slot->Taken = written;
+	return TRUE;
+}
+
+// drop the command waiting in a slot, a report command stays for the next take
+// Returns	(bool)	TRUE if a command was dropped
+static bool dropSlot(mailboxSlot *slot)
+{
+	mailboxCommand waiting;
+	uint8 taken = slot->Taken;
+
+	if( !readSlot(slot, &waiting) ) {
+		return FALSE;
+	}
+	if( COMMAND_IS_REPORT(waiting.Command) ) {
+		// only the consumer writes Taken, so this puts the command back
+		slot->Taken = taken;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// take the most urgent command, commands of less urgent producers that
+// are waiting at the same time are dropped (report commands neither drop
+// nor get dropped, they don't compete for the motion)
+// Returns	(bool)	TRUE if there was a command
+bool mailbox_take(mailboxCommand *command)
+{
+	uint8 i, j;
+
+	for (i=0; i<MAILBOX_PRODUCERS; i++)
+	{
+		if( !readSlot(&mailbox_slots[i], command) ) {
+			continue;
+		}
+		if( COMMAND_IS_REPORT(command->Command) ) {
+			// the motion executor never starts on it, keep the latency
+			// record of a motion command that is still waiting
+			return TRUE;
+		}
+		for (j=i+1; j<MAILBOX_PRODUCERS; j++) {
+			if( dropSlot(&mailbox_slots[j]) ) {
+				mailbox_dropped[j]++;
+			}
+		}
+		mailbox_last = *command;
+		mailbox_last_valid = TRUE;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// the motion executor has started on the command taken last
+// (records the time from post to execution once per command)
+void mailbox_executed(void)
+{
+	uint32 latency;
+	uint8 producer;
+
+	if( !mailbox_last_valid ) {
+		return;
+	}
+	mailbox_last_valid = FALSE;
+	latency_commandStarted(&mailbox_last);
+	producer = mailbox_last.Producer;
+	latency = clock_timestamp() - mailbox_last.Posted;
+	if( mailbox_executed_count[producer] == 0xFFFF ) {
+		return;
+	}
+	mailbox_executed_count[producer]++;
+	mailbox_latency_total[producer] += latency;
+	if( latency > mailbox_latency_max[producer] ) {
+		mailbox_latency_max[producer] = latency;
+	}
+}
+
+// print the post to execution latency and the dropped commands per producer
+void mailbox_report(void)
+{
+	char name[10];
+	uint8 i;
+
+	printf_P(PSTR("\nProducer   executed  mean ms   max ms  dropped\n"));
+	for (i=0; i<MAILBOX_PRODUCERS; i++)
+	{
+		strcpy_P(name, (PGM_P)pgm_read_word(&(MAILBOXNAME_POINTER[i])));
+		printf_P(PSTR("%-9s  %8u"), name, mailbox_executed_count[i]);
+		if( mailbox_executed_count[i] > 0 ) {
+			printf_P(PSTR("  %7lu  %7lu"),
+				(unsigned long) (mailbox_latency_total[i] / mailbox_executed_count[i] / (CLOCK_COUNTS_PER_US * 1000L)),
+				(unsigned long) (mailbox_latency_max[i] / (CLOCK_COUNTS_PER_US * 1000L)));
+		} else {
+			printf_P(PSTR("        -        -"));
+		}
+		printf_P(PSTR("  %7u\n"), mailbox_dropped[i]);
+	}
+	printf_P(PSTR("> "));
+}
@@ -0,0 +1,63 @@
+/*
+ * mailbox.h - command mailbox between the command producers (buttons,
+ *	sensors, serial port, obstacle avoidance) and the motion executor
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+
+#include "global.h"
+
+// The producers, most urgent first. Each producer has its own slot and is
+// the only one writing to it, a newer command replaces its older one.
+#define MAILBOX_SAFETY			0		// emergency stop and low battery (both task_command)
+#define MAILBOX_RECOVERY		1		// getting up after a fall
+#define MAILBOX_OPERATOR		2		// serial commands
+#define MAILBOX_AUTONOMY		3		// obstacle avoidance
+#define MAILBOX_PRODUCERS		4
+
+// one command as posted by a producer
+typedef struct
+{
+	uint8  Command;				// COMMAND_xxx
+	uint8  MotionPage;			// page of the command (if any)
+	uint8  Sequence;			// combo sequence of COMMAND_SEQUENCE
+	uint8  Producer;			// MAILBOX_xxx (filled in by mailbox_post)
+	uint32 Received;			// clock_timestamp() when the command came in
+	uint32 Posted;				// clock_timestamp() when posted
+} mailboxCommand;
+
+// post a command, only ever called by the owner of the slot
+void mailbox_post(uint8 producer, uint8 command, uint8 page, uint8 sequence);
+
+// post a command that came in earlier (received is its clock_timestamp())
+void mailbox_postReceived(uint8 producer, uint8 command, uint8 page, uint8 sequence, uint32 received);
+
+// take the most urgent command, commands of less urgent producers that
+// are waiting at the same time are dropped (report commands neither drop
+// nor get dropped, they don't compete for the motion)
+// Returns	(bool)	TRUE if there was a command
+bool mailbox_take(mailboxCommand *command);
+
+// the motion executor has started on the command taken last
+// (records the time from post to execution once per command)
+void mailbox_executed(void);
+
+// print the post to execution latency and the dropped commands per producer
+void mailbox_report(void);
+
+#endif /* MAILBOX_H_ */
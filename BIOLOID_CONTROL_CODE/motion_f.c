@@ -0,0 +1,1018 @@
+/*
+ * motion_f.c - functions for unpacking and executing the motion pages
+ *	defined in the motion.h file generated by MotionParser.pl
+ *
+ * Version 0.6
+ * Based on the BioloidCControl motion functions by Peter Lanius
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+#include "global.h"
+#include "motion.h"			// generated by MotionParser.pl - only include it here!
+#include "motion_f.h"
+#include "pose.h"
+#include "walk.h"
+#include "clock.h"
+#include "dynamixel.h"
+#include "motion_image.h"
+#include "motion_sequence.h"
+#include "profile.h"
+#include "mailbox.h"
+#include "scheduler.h"
+
+// Compile-time checks of the motion file against the robot configuration in
+// global.h - a negative array size stops the build (no _Static_assert in gcc 4.5)
+#define MOTION_STATIC_ASSERT(condition, name)	typedef char motion_check_##name[(condition) ? 1 : -1]
+#ifndef MOTION_TIMES_PRESCALED
+  #error "motion.h is out of date - run MotionParser.pl again"
+#endif
+MOTION_STATIC_ASSERT(MOTION_FILE_SERVOS == NUM_AX12_SERVOS, servo_count);
+MOTION_STATIC_ASSERT(MOTION_FILE_MAX_STEPS <= MAX_MOTION_STEPS, step_count);
+MOTION_STATIC_ASSERT(MOTION_FILE_LAST_PAGE <= NUM_MOTION_PAGES, page_count);
+MOTION_STATIC_ASSERT(MOTION_FILE_MIN_VALUE >= 0 && MOTION_FILE_MAX_VALUE <= 1023, servo_range);
+MOTION_STATIC_ASSERT(MOTION_FILE_BYTES < 65536L, flash_size);	// page addresses are 16 bit
+
+// motion page states of the motion sequence
+#define MOTION_IDLE			0
+#define MOTION_RUNNING		1
+#define MOTION_EXITING		2
+#define MOTION_WALK_READY	3		// walk ready page before the first walk page
+
+// compliance settings (RoboPlus flexibility 1..7 = compliance slope 2^n)
+#define MIN_JOINT_FLEXIBILITY	1
+#define MAX_JOINT_FLEXIBILITY	7
+#define MIN_PUNCH				32		// AX-12 punch default and minimum useful value
+
+// global hardware definition variables
+extern const uint8 AX12_IDS[NUM_AX12_SERVOS];
+
+// Global variables related to the finite state machine that governs execution
+extern volatile uint8 bioloid_command;			// current command
+extern volatile uint8 last_bioloid_command;		// last command
+extern volatile bool  new_command;				// flag that we got a new command
+extern volatile uint8 current_motion_page;		// current motion page
+extern volatile uint8 next_motion_page;			// next motion page if we got new command
+extern volatile uint8 next_motion_sequence;		// sequence of the C# command
+extern volatile uint8 current_step;				// number of the current motion page step
+extern volatile uint8 command_producer;			// mailbox producer of the current command
+
+// the current motion page unpacked into RAM
+motionPage current_page;
+
+// Preemption policy of the motion pages, pages not listed use MOTION_PREEMPT_PAGE.
+// Walk commands while walking always wait for the page end (seamless walk_shift).
+// MOTION_PREEMPT_NEVER also holds for the pages the NextPage chain of such a
+// page leads to, whatever their own policy (see startMotionPage).
+const motionPreemptRange MOTION_PREEMPT_POLICY[] PROGMEM = {
+	// getting up has to finish, or the robot ends up on the floor again
+	{COMMAND_FRONT_GET_UP_MP, COMMAND_BACK_GET_UP_MP, MOTION_PREEMPT_NEVER},
+	// actions react to the opponent after the step in progress
+	{ACTION_FIRST_MP, ACTION_LAST_MP, MOTION_PREEMPT_NEXT_STEP},
+	// walking leaves via the exit page after the step in progress
+	{WALK_COMMAND_MP(COMMAND_WALK_FORWARD), WALK_COMMAND_MP(COMMAND_WALK_BWD_TURN_RIGHT)+11, MOTION_PREEMPT_NEXT_STEP},
+	// the balance pose only holds still, leave it right away
+	{COMMAND_BALANCE_MP, COMMAND_BALANCE_MP, MOTION_PREEMPT_CURRENT_STEP},
+};
+
+#define NUM_PREEMPT_RANGES	(sizeof(MOTION_PREEMPT_POLICY) / sizeof(MOTION_PREEMPT_POLICY[0]))
+
+// the page expected to follow the current one, unpacked ahead of time
+// (0 = nothing prefetched)
+static motionPage prefetch_page;
+static uint8 prefetch_page_number = 0;
+
+#ifdef MOTION_PAGE_CACHE
+// The pages of the last NextPage cycle that was started, decoded into RAM.
+// Pages are stored compactly in the order they are first played: the page
+// header, then values, times and speeds of each step.
+#define CACHE_EMPTY			0xFFFF		// cycle page not stored yet
+static uint8 cache_data[MOTION_PAGE_CACHE];
+static uint8 cache_pages[MOTION_CACHE_PAGES];		// page numbers of the cycle
+static uint16 cache_offset[MOTION_CACHE_PAGES];		// where each page sits in cache_data
+static uint8 cache_count = 0;						// pages in the cycle (0 = no cycle)
+static uint16 cache_used = 0;
+static uint32 cache_hits = 0;						// page starts from the cache
+static uint32 cache_misses = 0;						// page starts unpacked from Flash
+#endif
+
+// state of the motion sequence
+static uint8 motion_state = MOTION_IDLE;
+static uint8 command_pending = 0;		// new command waiting for the next step boundary
+static uint8 repeat_count = 0;			// number of times current page has been played
+static unsigned long step_start_time = 0;	// scheduler_now() once the goal of the current step was sent
+static uint16 step_duration = 0;			// play time plus pause time of the current step
+static uint8 page_preemption = MOTION_PREEMPT_PAGE;	// policy of the current page
+static bool chain_never = FALSE;			// a MOTION_PREEMPT_NEVER page started the current NextPage chain
+
+// the combo sequence being played and its next entry
+static uint8 sequence_number = MOTION_SEQUENCE_NONE;
+static uint8 sequence_index = 0;
+
+// shadow copies of the compliance slope and punch last written to the servos
+// (0 means unknown and forces a write)
+static uint8 compliance_shadow[NUM_AX12_SERVOS];
+static uint16 punch_shadow = 0;
+
+// the new implementation of AVR libc does not allow variables passed to _delay_ms
+static inline void delay_ms(uint16 count) {
+	while(count--) {
+		_delay_ms(1);
+	}
+}
+
+// initialize the motion pages
+// The page index is generated into Flash by MotionParser.pl, so there
+// are no pointers to set up any more
+void motionPageInit()
+{
+	// the servo ranges of the motion file bound the servo output
+	setPoseLimits(SERVO_MIN_VALUES, SERVO_MAX_VALUES);
+#ifdef MOTION_IMAGE_UPLOAD
+	// an uploaded motion image replaces the compiled-in pages (and limits)
+	motionImageInit();
+#endif
+}
+
+// find a compiled-in motion page via the page index in Flash
+// Returns	(uint32)	Flash address of the page, 0 if the page does not exist
+static uint32 motionPageAddress(uint8 page)
+{
+	uint8 slot;
+
+	slot = pgm_read_byte_far(pgm_get_far_address(MOTION_PAGE_INDEX) + page);
+	if( slot == MOTION_PAGE_NONE ) {
+		return 0;
+	}
+	return pgm_read_word_far(pgm_get_far_address(MOTION_PAGE_TABLE) + slot*sizeof(MOTION_PAGE_TABLE[0]));
+}
+
+// find a page in the active motion pages (uploaded image or compiled-in)
+// Returns	(uint32)	Flash address of the page, 0 if the page does not exist
+static uint32 activePageAddress(uint8 page)
+{
+#ifdef MOTION_IMAGE_UPLOAD
+	if( motionImageActive() ) {
+		return motionImagePageAddress(page);
+	}
+#endif
+	return motionPageAddress(page);
+}
+
+// Returns	(bool)	TRUE if the page exists (and has steps) in the active motion pages
+bool motionPageExists(uint8 page)
+{
+	return activePageAddress(page) != 0;
+}
+
+#if defined(MOTION_DELTA_ENCODED) || defined(MOTION_IMAGE_UPLOAD)
+// Decode one step of a delta encoded page (see MotionParser.pl -d)
+//   0xFF + 2 bytes per servo (high, low)	keyframe with absolute values
+//   0xxxxxxx							delta, zigzag encoded in 7 bits
+//   10nnnnnn							nnnnnn+1 unchanged values
+//   11xxxxxx xxxxxxxx					delta, zigzag encoded in 14 bits
+// The step is decoded into values[] relative to previous[], which may be
+// the same buffer. Returns the Flash address of the next step.
+static uint32 decodeDeltaStep(uint32 motion_addr, uint16 values[], const uint16 previous[])
+{
+	uint8 token, run, j = 0;
+	uint16 zigzag;
+
+	token = pgm_read_byte_far(motion_addr++);
+	if( token == MOTION_KEYFRAME_MARKER ) {
+		for (j=0; j<NUM_AX12_SERVOS; j++) {
+			values[j] = ((uint16) pgm_read_byte_far(motion_addr) << 8) | pgm_read_byte_far(motion_addr+1);
+			motion_addr += 2;
+		}
+		return motion_addr;
+	}
+
+	while( 1 ) {
+		if( (token & 0xC0) == 0x80 ) {
+			// run of unchanged values
+			run = (token & 0x3F) + 1;
+			while( run-- && j < NUM_AX12_SERVOS ) {
+				values[j] = previous[j];
+				j++;
+			}
+		} else {
+			if( token & 0x80 ) {
+				zigzag = ((uint16) (token & 0x3F) << 8) | pgm_read_byte_far(motion_addr++);
+			} else {
+				zigzag = token;
+			}
+			// zigzag: even values are positive, odd values negative
+			if( zigzag & 1 ) {
+				values[j] = previous[j] - ((zigzag + 1) >> 1);
+			} else {
+				values[j] = previous[j] + (zigzag >> 1);
+			}
+			j++;
+		}
+		if( j >= NUM_AX12_SERVOS ) {
+			return motion_addr;
+		}
+		token = pgm_read_byte_far(motion_addr++);
+	}
+}
+#endif
+
+// unpack the precomputed step times and servo speeds (steps 2..n) of a page
+// Returns the Flash address after the speeds
+static uint32 unpackStepSpeeds(uint32 motion_addr, motionPage *motion_page)
+{
+	uint8 i, j;
+
+	for (i=0; i<motion_page->Steps; i++) {
+		motion_page->StepTime[i] = pgm_read_word_far(motion_addr);
+		motion_addr += 2;
+	}
+	for (i=1; i<motion_page->Steps; i++) {
+		for (j=0; j<NUM_AX12_SERVOS; j++) {
+			motion_page->StepSpeeds[i-1][j] = pgm_read_byte_far(motion_addr++);
+		}
+	}
+	return motion_addr;
+}
+
+// unpack a motion page from Flash into a page buffer in RAM
+// Pages are read with far reads, so they can come from the compiled-in
+// pages or from an uploaded motion image anywhere in Flash
+static void unpackMotionPage(int StartPage, motionPage *motion_page)
+{
+	uint32 motion_addr;
+	uint8 i;
+#ifdef MOTION_DELTA_ENCODED
+	bool delta_encoded = TRUE;
+#else
+	bool delta_encoded = FALSE;
+	uint32 packed_value;
+	uint8 j, k;
+#endif
+
+	// find the start of the motion page in Flash
+#ifdef MOTION_IMAGE_UPLOAD
+	if( motionImageActive() ) {
+		// uploaded images are always delta encoded
+		motion_addr = motionImagePageAddress(StartPage);
+		delta_encoded = TRUE;
+	} else
+#endif
+	{
+		motion_addr = motionPageAddress(StartPage);
+	}
+	if( motion_addr == 0 ) {
+		// page does not exist - make it an empty page
+		motion_page->Steps = 0;
+		motion_page->NextPage = 0;
+		motion_page->ExitPage = 0;
+		motion_page->RepeatTime = 1;
+		return;
+	}
+	PROFILE_START(PROFILE_UNPACK);
+
+	// the page layout is defined by MotionParser.pl
+	for (i=0; i<NUM_AX12_SERVOS; i++) {
+		motion_page->JointFlexibility[i] = pgm_read_byte_far(motion_addr++);
+	}
+	motion_page->NextPage = pgm_read_byte_far(motion_addr++);
+	motion_page->ExitPage = pgm_read_byte_far(motion_addr++);
+	motion_page->RepeatTime = pgm_read_byte_far(motion_addr++);
+	motion_page->SpeedRate10 = pgm_read_byte_far(motion_addr++);
+	motion_page->InertialForce = pgm_read_byte_far(motion_addr++);
+	motion_page->Steps = pgm_read_byte_far(motion_addr++);
+	if( motion_page->Steps > MAX_MOTION_STEPS ) {
+		// can't be skipped safely (compiled-in pages are checked at compile time)
+		printf_P(PSTR("\nunpackMotion - page %i has too many steps\n"), StartPage);
+		motion_page->Steps = 0;
+		return;
+	}
+
+	if( delta_encoded ) {
+#if defined(MOTION_DELTA_ENCODED) || defined(MOTION_IMAGE_UPLOAD)
+		// the pause and play times come first, then the variable length steps
+		for (i=0; i<motion_page->Steps; i++) {
+			motion_page->PauseTime[i] = pgm_read_word_far(motion_addr);
+			motion_addr += 2;
+		}
+		for (i=0; i<motion_page->Steps; i++) {
+			motion_page->PlayTime[i] = pgm_read_word_far(motion_addr);
+			motion_addr += 2;
+		}
+		motion_addr = unpackStepSpeeds(motion_addr, motion_page);
+		for (i=0; i<motion_page->Steps; i++) {
+			motion_addr = decodeDeltaStep(motion_addr, motion_page->StepValues[i],
+					(i > 0) ? motion_page->StepValues[i-1] : motion_page->StepValues[0]);
+		}
+#endif
+	}
+#ifndef MOTION_DELTA_ENCODED
+	else {
+		// unpack the servo values (3 x 11 bits in each uint32)
+		for (i=0; i<motion_page->Steps; i++) {
+			k = 0;
+			for (j=0; j<PACKED_AX12_SERVOS; j++) {
+				packed_value = pgm_read_dword_far(motion_addr);
+				motion_addr += 4;
+				motion_page->StepValues[i][k++] = (uint16) (packed_value >> 22) & 0x07FF;
+				if( k < NUM_AX12_SERVOS ) motion_page->StepValues[i][k++] = (uint16) (packed_value >> 11) & 0x07FF;
+				if( k < NUM_AX12_SERVOS ) motion_page->StepValues[i][k++] = (uint16) packed_value & 0x07FF;
+			}
+		}
+		// and finally the pause and play times
+		for (i=0; i<motion_page->Steps; i++) {
+			motion_page->PauseTime[i] = pgm_read_word_far(motion_addr);
+			motion_addr += 2;
+		}
+		for (i=0; i<motion_page->Steps; i++) {
+			motion_page->PlayTime[i] = pgm_read_word_far(motion_addr);
+			motion_addr += 2;
+		}
+		unpackStepSpeeds(motion_addr, motion_page);
+	}
+#endif
+	PROFILE_END(PROFILE_UNPACK);
+}
+
+// unpack a motion page from Flash into the current page in RAM
+void unpackMotion(int StartPage)
+{
+	unpackMotionPage(StartPage, &current_page);
+}
+
+#ifdef MOTION_PAGE_CACHE
+// page header as stored in the cache: the motionPage fields before StepValues
+#define CACHE_HEADER_SIZE	(NUM_AX12_SERVOS + 6)
+
+// Returns	(uint16)	bytes a page with the given number of steps takes in the cache
+static uint16 cachedPageSize(uint8 steps)
+{
+	return CACHE_HEADER_SIZE + steps*(2*NUM_AX12_SERVOS + 6) + (steps-1)*NUM_AX12_SERVOS;
+}
+
+// Returns	(int)	slot of the page in the cached cycle, -1 if it is not part of it
+static int cacheSlot(uint8 page)
+{
+	for (uint8 i=0; i<cache_count; i++) {
+		if( cache_pages[i] == page ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Returns	(bool)	TRUE if the page is decoded in the cache
+static bool motionPageCached(uint8 page)
+{
+	int slot = cacheSlot(page);
+
+	return slot >= 0 && cache_offset[slot] != CACHE_EMPTY;
+}
+
+// Follow the NextPage chain from a page through the page headers in Flash.
+// If it comes back to the page and the whole cycle fits into the cache, the
+// cycle becomes the cached one (its pages are stored as they are played).
+// Returns	(bool)	TRUE if the page starts a new cached cycle
+static bool cacheNewCycle(uint8 page)
+{
+	uint8 pages[MOTION_CACHE_PAGES], count = 0, next = page, steps;
+	uint16 bytes = 0;
+	uint32 motion_addr;
+
+	do {
+		if( count == MOTION_CACHE_PAGES ) {
+			return FALSE;
+		}
+		motion_addr = activePageAddress(next);
+		if( motion_addr == 0 ) {
+			return FALSE;
+		}
+		steps = pgm_read_byte_far(motion_addr + NUM_AX12_SERVOS + 5);
+		if( steps == 0 || steps > MAX_MOTION_STEPS ) {
+			return FALSE;
+		}
+		bytes += cachedPageSize(steps);
+		pages[count++] = next;
+		next = pgm_read_byte_far(motion_addr + NUM_AX12_SERVOS);
+	} while( next != page );
+	if( bytes > MOTION_PAGE_CACHE ) {
+		return FALSE;
+	}
+
+	for (uint8 i=0; i<count; i++) {
+		cache_pages[i] = pages[i];
+		cache_offset[i] = CACHE_EMPTY;
+	}
+	cache_count = count;
+	cache_used = 0;
+	return TRUE;
+}
+
+// store the current page in the cache if it is part of the cached cycle
+// (a page outside of it starts a new cycle if it is cyclic itself)
+static void cacheCurrentPage(uint8 page)
+{
+	uint8 *data;
+	int slot = cacheSlot(page);
+
+	if( slot < 0 ) {
+		// other pages (exit pages, single moves) leave the cached cycle alone
+		if( !cacheNewCycle(page) ) {
+			return;
+		}
+		slot = 0;
+	}
+	if( cache_offset[slot] != CACHE_EMPTY ) {
+		return;
+	}
+	// the cycle was sized from the page headers, so it always fits
+	cache_offset[slot] = cache_used;
+	data = &cache_data[cache_used];
+	memcpy(data, &current_page, CACHE_HEADER_SIZE);
+	data += CACHE_HEADER_SIZE;
+	for (uint8 i=0; i<current_page.Steps; i++) {
+		memcpy(data, current_page.StepValues[i], 2*NUM_AX12_SERVOS);
+		data += 2*NUM_AX12_SERVOS;
+		memcpy(data, &current_page.PauseTime[i], 2);
+		memcpy(data+2, &current_page.PlayTime[i], 2);
+		memcpy(data+4, &current_page.StepTime[i], 2);
+		data += 6;
+		if( i > 0 ) {
+			memcpy(data, current_page.StepSpeeds[i-1], NUM_AX12_SERVOS);
+			data += NUM_AX12_SERVOS;
+		}
+	}
+	cache_used += cachedPageSize(current_page.Steps);
+}
+
+// copy a page from the cache into the current page
+// Returns	(bool)	FALSE if the page is not in the cache
+static bool loadCachedPage(uint8 page)
+{
+	const uint8 *data;
+	int slot = cacheSlot(page);
+
+	if( slot < 0 || cache_offset[slot] == CACHE_EMPTY ) {
+		return FALSE;
+	}
+	data = &cache_data[cache_offset[slot]];
+	memcpy(&current_page, data, CACHE_HEADER_SIZE);
+	data += CACHE_HEADER_SIZE;
+	for (uint8 i=0; i<current_page.Steps; i++) {
+		memcpy(current_page.StepValues[i], data, 2*NUM_AX12_SERVOS);
+		data += 2*NUM_AX12_SERVOS;
+		memcpy(&current_page.PauseTime[i], data, 2);
+		memcpy(&current_page.PlayTime[i], data+2, 2);
+		memcpy(&current_page.StepTime[i], data+4, 2);
+		data += 6;
+		if( i > 0 ) {
+			memcpy(current_page.StepSpeeds[i-1], data, NUM_AX12_SERVOS);
+			data += NUM_AX12_SERVOS;
+		}
+	}
+	return TRUE;
+}
+#endif
+
+// print the motion page cache statistics
+void motionCacheReport(void)
+{
+#ifdef MOTION_PAGE_CACHE
+	uint32 total = cache_hits + cache_misses;
+
+	printf_P(PSTR("\nMotion page cache - %i page cycle"), cache_count);
+	if( cache_count > 0 ) {
+		printf_P(PSTR(" from page %i"), cache_pages[0]);
+	}
+	printf_P(PSTR(", %i of %i bytes used\n"), cache_used, MOTION_PAGE_CACHE);
+	printf_P(PSTR("%lu hits, %lu misses"), (unsigned long) cache_hits, (unsigned long) cache_misses);
+	if( total > 0 ) {
+		printf_P(PSTR(" (%lu%% hits)"), (unsigned long) (cache_hits * 100 / total));
+	}
+	printf_P(PSTR("\n> "));
+#else
+	printf_P(PSTR("\nMotion page cache disabled (MOTION_PAGE_CACHE in global.h)\n> "));
+#endif
+}
+
+// Apply the joint flexibility and inertial force of the current page
+// Flexibility is translated into the CW/CCW compliance slope (adjacent
+// registers, so one word per servo) and only servos whose slope differs
+// from the shadow copy are written, all in a single sync write.
+// Inertial force is used as the punch (RoboPlus default 32 = AX-12 default).
+// Pages played while walking keep the punch set by walk_init().
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+static int setMotionPageCompliance()
+{
+	uint8 ids[NUM_AX12_SERVOS], count = 0, flex, slope;
+	int16 values[NUM_AX12_SERVOS];
+	uint16 punch;
+	int commStatus;
+
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++)
+	{
+		flex = current_page.JointFlexibility[i];
+		if( flex < MIN_JOINT_FLEXIBILITY ) flex = MIN_JOINT_FLEXIBILITY;
+		if( flex > MAX_JOINT_FLEXIBILITY ) flex = MAX_JOINT_FLEXIBILITY;
+		slope = 1 << flex;
+		if( slope != compliance_shadow[i] ) {
+			ids[count] = AX12_IDS[i];
+			values[count] = (int16) ((uint16) slope << 8 | slope);	// CW slope low byte, CCW slope high byte
+			compliance_shadow[i] = slope;
+			count++;
+		}
+	}
+
+	if( count > 0 ) {
+		commStatus = dxl_sync_write_word(count, DXL_CW_COMPLIANCE_SLOPE, ids, values);
+		if(commStatus != COMM_RXSUCCESS) {
+			// we don't know what the servos have now, force a rewrite next time
+			for (uint8 i=0; i<NUM_AX12_SERVOS; i++) {
+				compliance_shadow[i] = 0;
+			}
+			printf_P(PSTR("\nsetMotionPageCompliance - "));
+			dxl_printCommStatus(commStatus);
+			return -1;
+		}
+	}
+
+	// punch registers are not adjacent to the slopes, so they need their own write
+	if( walk_getWalkState() != 0 ) {
+		// walk_init() has set the walking punch
+		punch_shadow = 0;
+		return 0;
+	}
+	punch = current_page.InertialForce;
+	if( punch < MIN_PUNCH ) punch = MIN_PUNCH;
+	if( punch != punch_shadow ) {
+		commStatus = dxl_write_word(BROADCAST_ID, DXL_PUNCH_L, punch);
+		if(commStatus != COMM_RXSUCCESS) {
+			punch_shadow = 0;
+			printf_P(PSTR("\nsetMotionPageCompliance - "));
+			dxl_printCommStatus(commStatus);
+			return -1;
+		}
+		punch_shadow = punch;
+	}
+	return 0;
+}
+
+// Returns	(uint8)	MOTION_PREEMPT_xxx policy of a page
+static uint8 motionPagePreemption(uint8 page)
+{
+	motionPreemptRange range;
+
+	for (uint8 i=0; i<NUM_PREEMPT_RANGES; i++)
+	{
+		memcpy_P(&range, &MOTION_PREEMPT_POLICY[i], sizeof(motionPreemptRange));
+		if( page >= range.FirstPage && page <= range.LastPage ) {
+			return range.Policy;
+		}
+	}
+	return MOTION_PREEMPT_PAGE;
+}
+
+// Returns	(bool)	TRUE if the pending command is acted upon at the end of the page
+static bool commandAtPageEnd()
+{
+	return command_pending == 1 && page_preemption != MOTION_PREEMPT_NEVER;
+}
+
+// Returns	(bool)	TRUE if the pending command may end the current page before
+//					its last step (urgent producer and the page policy allows it)
+static bool commandPreempts()
+{
+	if( command_pending == 0 || command_producer > MOTION_PREEMPT_PRODUCER ) {
+		return FALSE;
+	}
+	// the exit page brings the robot into a stable pose, it always plays to the end
+	// (the same for the walk ready page)
+	if( motion_state == MOTION_EXITING || motion_state == MOTION_WALK_READY ) {
+		return FALSE;
+	}
+	if( page_preemption != MOTION_PREEMPT_NEXT_STEP && page_preemption != MOTION_PREEMPT_CURRENT_STEP ) {
+		return FALSE;
+	}
+	// walk commands shift seamlessly at the end of the walk page
+	if( walk_getWalkState() != 0 && bioloid_command >= COMMAND_WALK_FORWARD
+			&& bioloid_command <= COMMAND_WALK_BWD_TURN_RIGHT ) {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// start executing a motion page from its first step
+// uses the cached cycle or the prefetched page if we guessed right
+static void startMotionPage(uint8 page)
+{
+	current_motion_page = page;
+#ifdef MOTION_PAGE_CACHE
+	if( loadCachedPage(page) ) {
+		cache_hits++;
+	} else
+#endif
+	{
+		if( prefetch_page_number != 0 && prefetch_page_number == page ) {
+			memcpy(&current_page, &prefetch_page, sizeof(motionPage));
+			prefetch_page_number = 0;
+		} else {
+			unpackMotion(page);
+		}
+#ifdef MOTION_PAGE_CACHE
+		cache_misses++;
+		cacheCurrentPage(page);
+#endif
+	}
+	setMotionPageCompliance();
+	// a MOTION_PREEMPT_NEVER page keeps the policy for the rest of its chain
+	page_preemption = motionPagePreemption(page);
+	if( page_preemption == MOTION_PREEMPT_NEVER ) {
+		chain_never = TRUE;
+	} else if( chain_never ) {
+		page_preemption = MOTION_PREEMPT_NEVER;
+	}
+	current_step = 0;
+	repeat_count = 0;
+	motion_state = MOTION_RUNNING;
+}
+
+// Start the next entry of the combo sequence whose guard holds
+// Returns	(int)	  -1  - a guard stopped the sequence
+//					   0  - no more entries
+//					   1  - entry started
+static int startSequenceEntry()
+{
+	motionSequenceEntry entry;
+
+	while( motionSequenceGetEntry(sequence_number, sequence_index, &entry) )
+	{
+		sequence_index++;
+		if( motionSequenceGuard(&entry) ) {
+			// each entry starts its own chain
+			chain_never = FALSE;
+			startMotionPage(entry.Page);
+			// the entry's repeat count replaces the one of the page
+			if( entry.Repeat != 0 ) {
+				current_page.RepeatTime = entry.Repeat;
+			}
+			return 1;
+		}
+		if( (entry.Guard & MOTION_GUARD_SKIP) == 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Execute a motion page (and any pages chained via NextPage) and wait
+// for each step to finish. Used for initial poses only, blocks until done.
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+//					   1  - alarm
+int executeMotion(int StartPage)
+{
+	int page = StartPage, status;
+	uint8 repeat;
+
+	while( page != 0 )
+	{
+		current_motion_page = page;
+		unpackMotion(page);
+		setMotionPageCompliance();
+
+		// play the page as often as required
+		repeat = current_page.RepeatTime > 0 ? current_page.RepeatTime : 1;
+		while( repeat-- )
+		{
+			for (uint8 i=0; i<current_page.Steps; i++)
+			{
+				current_step = i;
+				status = moveToGoalPose(current_page.PlayTime[i], current_page.StepValues[i], WAIT_FOR_POSE_FINISH);
+				if( status != 0 ) {
+					return status;
+				}
+				delay_ms(current_page.PauseTime[i]);
+			}
+		}
+
+		// follow the chain of pages, but don't loop forever
+		page = current_page.NextPage;
+		if( page == StartPage ) {
+			break;
+		}
+	}
+	motion_state = MOTION_IDLE;
+	return 0;
+}
+
+// Execute a single step of the current motion page without waiting
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+int executeMotionStep(int Step)
+{
+	uint16 play_time, pause_time;
+	int status;
+	PROFILE_START(PROFILE_STEP);
+
+	// the times already include the page speed rate (done by MotionParser.pl)
+	play_time = current_page.PlayTime[Step];
+	pause_time = current_page.PauseTime[Step];
+
+	if( Step > 0 && getPoseTimingMode() == POSE_TIMING_AS_AUTHORED ) {
+		// the step starts from the previous step, use the precomputed speeds
+		status = moveToGoalPoseWithSpeeds(current_page.StepTime[Step], current_page.StepValues[Step],
+				current_page.StepSpeeds[Step-1], DONT_WAIT_FOR_POSE_FINISH);
+	} else {
+		// first step after a page transition, calculate the speeds from the current pose
+		status = moveToGoalPose(play_time, current_page.StepValues[Step], DONT_WAIT_FOR_POSE_FINISH);
+	}
+	// The servos start moving with the sync write, the step time counts from
+	// there. The pass snapshot is older (page unpack and write), so take it again.
+	step_start_time = scheduler_refresh();
+	// the step is finished after the effective play time and pause time have passed
+	step_duration = getPoseStepTime() + pause_time;
+	PROFILE_END(PROFILE_STEP);
+	return status;
+}
+
+// leave the current motion via the exit page of the current page
+// (the exit page ends the chain, it plays with its own policy)
+static void startExitPage()
+{
+	chain_never = FALSE;
+	startMotionPage(current_page.ExitPage);
+	motion_state = MOTION_EXITING;
+}
+
+// act on the current command now that the robot is ready for it
+static void beginCommand()
+{
+	command_pending = 0;
+	chain_never = FALSE;
+	mailbox_executed();
+
+	if( bioloid_command == COMMAND_STOP || bioloid_command == COMMAND_NOT_FOUND ) {
+		motion_state = MOTION_IDLE;
+		return;
+	}
+
+	sequence_number = MOTION_SEQUENCE_NONE;
+	if( bioloid_command == COMMAND_SEQUENCE ) {
+		// the sequence was checked when the command came in
+		walk_setWalkState(0);
+		sequence_number = next_motion_sequence;
+		sequence_index = 0;
+		if( startSequenceEntry() != 1 ) {
+			sequence_number = MOTION_SEQUENCE_NONE;
+			motion_state = MOTION_IDLE;
+		}
+		return;
+	}
+
+	if( bioloid_command >= COMMAND_WALK_FORWARD && bioloid_command <= COMMAND_WALK_BWD_TURN_RIGHT ) {
+		// get ready to walk first if required, the walk page follows the
+		// walk ready page (played like any other page, the loop carries on)
+		if( walk_getWalkState() == 0 ) {
+			startMotionPage(COMMAND_WALK_READY_MP);
+			motion_state = MOTION_WALK_READY;
+			return;
+		}
+		walk_setWalkState(bioloid_command);
+	} else {
+		walk_setWalkState(0);
+	}
+	startMotionPage(next_motion_page);
+}
+
+// Decide which page follows once all steps of the current page are done
+// Returns	(int)	0 - motion finished
+//					1 - next page ready to execute
+static int selectNextMotionPage()
+{
+	// repeat the current page unless we have something else to do
+	repeat_count++;
+	if( repeat_count < current_page.RepeatTime && !commandAtPageEnd() ) {
+		current_step = 0;
+		return 1;
+	}
+
+	// exit page finished - the robot is in a stable pose again
+	if( motion_state == MOTION_EXITING ) {
+		walk_setWalkState(0);
+		if( commandAtPageEnd() ) {
+			beginCommand();
+			return (motion_state != MOTION_IDLE);
+		}
+		motion_state = MOTION_IDLE;
+		return 0;
+	}
+
+	// walk ready pose reached - start walking, unless a newer command
+	// is no walk command (a newer walk command starts right away)
+	if( motion_state == MOTION_WALK_READY ) {
+		if( bioloid_command < COMMAND_WALK_FORWARD || bioloid_command > COMMAND_WALK_BWD_TURN_RIGHT ) {
+			beginCommand();
+			return (motion_state != MOTION_IDLE);
+		}
+		if( command_pending == 1 ) {
+			command_pending = 0;
+			mailbox_executed();
+		}
+		walk_init();
+		walk_setWalkState(bioloid_command);
+		startMotionPage(next_motion_page);
+		return 1;
+	}
+
+	if( commandAtPageEnd() ) {
+		// some walk commands allow a seamless transition
+		if( walk_getWalkState() != 0 && walk_shift() == 1 ) {
+			command_pending = 0;
+			mailbox_executed();
+			startMotionPage(current_motion_page);
+			return 1;
+		}
+		// all others have to leave the current motion via the exit page
+		if( current_page.ExitPage != 0 ) {
+			startExitPage();
+			return 1;
+		}
+		beginCommand();
+		return (motion_state != MOTION_IDLE);
+	}
+
+	// a combo sequence continues with its next entry instead of NextPage
+	if( sequence_number != MOTION_SEQUENCE_NONE ) {
+		switch( startSequenceEntry() ) {
+			case 1:
+				return 1;
+			case -1:
+				// a guard failed - leave the current motion via its exit page
+				sequence_number = MOTION_SEQUENCE_NONE;
+				if( current_page.ExitPage != 0 ) {
+					startExitPage();
+					return 1;
+				}
+				motion_state = MOTION_IDLE;
+				return 0;
+		}
+		// sequence done, the NextPage of the last page applies
+		sequence_number = MOTION_SEQUENCE_NONE;
+	}
+
+	// otherwise continue with the next page in the chain
+	if( current_page.NextPage != 0 ) {
+		startMotionPage(current_page.NextPage);
+		return 1;
+	}
+
+	// all done (a command held back by a MOTION_PREEMPT_NEVER chain starts now)
+	chain_never = FALSE;
+	walk_setWalkState(0);
+	motion_state = MOTION_IDLE;
+	return 0;
+}
+
+// Guess which page follows the current one, using the same rules as
+// selectNextMotionPage. Walk shifts can't be predicted (walk_shift changes
+// the walk state), the exit page is assumed instead.
+// Returns	(uint8)	page number, 0 if no new page is expected yet
+static uint8 predictNextMotionPage()
+{
+	// not yet at the last step (and not preempted), or the page will be repeated
+	if( current_step < current_page.Steps && !commandPreempts() ) {
+		return 0;
+	}
+	if( repeat_count+1 < current_page.RepeatTime && !commandAtPageEnd() ) {
+		return 0;
+	}
+	if( motion_state == MOTION_EXITING ) {
+		return commandAtPageEnd() ? next_motion_page : 0;
+	}
+	if( motion_state == MOTION_WALK_READY ) {
+		return next_motion_page;
+	}
+	if( commandAtPageEnd() ) {
+		return (current_page.ExitPage != 0) ? current_page.ExitPage : next_motion_page;
+	}
+	// the next entry of a combo sequence, assuming its guard holds
+	if( sequence_number != MOTION_SEQUENCE_NONE ) {
+		motionSequenceEntry entry;
+		if( motionSequenceGetEntry(sequence_number, sequence_index, &entry) ) {
+			return entry.Page;
+		}
+	}
+	return current_page.NextPage;
+}
+
+// Unpack the page expected next into the prefetch buffer while the last
+// step of the current page is still playing, so the page transition costs
+// no more than an ordinary step. A wrong guess just means a normal unpack.
+static void prefetchNextMotionPage()
+{
+	uint8 page = predictNextMotionPage();
+
+	if( page == 0 || page == prefetch_page_number ) {
+		return;
+	}
+#ifdef MOTION_PAGE_CACHE
+	// pages of the cached cycle are ready anyway
+	if( motionPageCached(page) ) {
+		return;
+	}
+#endif
+	unpackMotionPage(page, &prefetch_page);
+	prefetch_page_number = page;
+}
+
+// Returns	(bool)	TRUE while the motion executor plays a page
+bool motionIsRunning(void)
+{
+	return (motion_state != MOTION_IDLE);
+}
+
+// discard the prefetched and cached pages (the motion pages in Flash have changed)
+void motionPrefetchInvalidate(void)
+{
+	prefetch_page_number = 0;
+#ifdef MOTION_PAGE_CACHE
+	cache_count = 0;
+	cache_used = 0;
+#endif
+}
+
+// Top level motion task called from the main loop
+// Executes one step of the current motion page whenever the previous step
+// has finished and takes care of the transitions between motion pages
+void executeMotionSequence()
+{
+	// take note of a new command, it is acted upon at the end of the page, or
+	// at the next step boundary if it is urgent and the page policy allows it
+	if( new_command == TRUE ) {
+		new_command = FALSE;
+		if( bioloid_command == COMMAND_STOP ) {
+			// emergency stop takes effect immediately
+			beginCommand();
+			walk_setWalkState(0);
+			return;
+		}
+		// same walk command as the one we are executing - nothing to do
+		if( motion_state != MOTION_IDLE && bioloid_command == walk_getWalkState() ) {
+			command_pending = 0;
+		} else {
+			command_pending = 1;
+		}
+	}
+
+	if( motion_state == MOTION_IDLE ) {
+		// start a new motion if we have one
+		if( command_pending == 0 ) {
+			return;
+		}
+		beginCommand();
+		if( motion_state == MOTION_IDLE ) {
+			return;
+		}
+	} else if( (scheduler_now() - step_start_time) < step_duration ) {
+		// current step is still executing, unless an urgent command aborts it
+		if( !commandPreempts() || page_preemption != MOTION_PREEMPT_CURRENT_STEP ) {
+			// use the time to get the next page ready
+			prefetchNextMotionPage();
+			return;
+		}
+	}
+
+	// an urgent command ends the page here, the remaining steps are skipped
+	if( current_step < current_page.Steps && commandPreempts() ) {
+		current_step = current_page.Steps;
+	}
+
+	// find out what comes next once the current page is done
+	if( current_step >= current_page.Steps ) {
+		if( selectNextMotionPage() == 0 ) {
+			return;
+		}
+		// skip empty pages
+		if( current_page.Steps == 0 ) {
+			return;
+		}
+	}
+
+	// execute the step
+	executeMotionStep(current_step);
+	current_step++;
+}
@@ -0,0 +1,97 @@
+/*
+ * motion_f.h - functions for unpacking and executing the motion pages
+ *	defined in the motion.h file generated by MotionParser.pl
+ *
+ * Version 0.6
+ * Based on the BioloidCControl motion functions by Peter Lanius
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MOTION_F_H_
+#define MOTION_F_H_
+
+// number of packed uint32 values per step in motion.h (3 servo values each)
+#define PACKED_AX12_SERVOS	((NUM_AX12_SERVOS+2)/3)
+
+// marker byte of a keyframe step in delta encoded pages (MotionParser.pl -d and -b)
+#define MOTION_KEYFRAME_MARKER	0xFF
+
+// preemption policies of the motion pages (see MOTION_PREEMPT_POLICY in motion_f.c)
+#define MOTION_PREEMPT_PAGE			0	// a new command waits for the end of the page (default)
+#define MOTION_PREEMPT_NEXT_STEP	1	// an urgent command ends the page after the current step
+#define MOTION_PREEMPT_CURRENT_STEP	2	// an urgent command aborts the current step
+#define MOTION_PREEMPT_NEVER		3	// the page and the pages its NextPage chain leads to play to the end
+
+// range of motion pages sharing a preemption policy
+typedef struct
+{
+	uint8 FirstPage;
+	uint8 LastPage;
+	uint8 Policy;				// MOTION_PREEMPT_xxx
+} motionPreemptRange;
+
+// motion page as unpacked from Flash into RAM
+typedef struct
+{
+	uint8  JointFlexibility[NUM_AX12_SERVOS];
+	uint8  NextPage;
+	uint8  ExitPage;
+	uint8  RepeatTime;
+	uint8  SpeedRate10;
+	uint8  InertialForce;
+	uint8  Steps;
+	uint16 StepValues[MAX_MOTION_STEPS][NUM_AX12_SERVOS];
+	uint16 PauseTime[MAX_MOTION_STEPS];		// ms, already scaled by SpeedRate10
+	uint16 PlayTime[MAX_MOTION_STEPS];		// ms, already scaled by SpeedRate10
+	uint16 StepTime[MAX_MOTION_STEPS];		// ms, effective time of steps 2..n (precomputed)
+	uint8  StepSpeeds[MAX_MOTION_STEPS-1][NUM_AX12_SERVOS];	// speed/4 of steps 2..n (precomputed)
+} motionPage;
+
+// initialize the motion pages (sets the servo limits of the motion file)
+void motionPageInit(void);
+
+// Returns	(bool)	TRUE if the page exists (and has steps) in the active motion pages
+bool motionPageExists(uint8 page);
+
+// unpack a motion page from Flash into the current page in RAM
+void unpackMotion(int StartPage);
+
+// Execute a motion page (and any pages chained via NextPage) and wait
+// for each step to finish. Used for initial poses only, blocks until done.
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+//					   1  - alarm
+int executeMotion(int StartPage);
+
+// Execute a single step of the current motion page without waiting
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+int executeMotionStep(int Step);
+
+// Returns	(bool)	TRUE while the motion executor plays a page
+bool motionIsRunning(void);
+
+// discard the prefetched and cached pages (the motion pages in Flash have changed)
+void motionPrefetchInvalidate(void);
+
+// print the hit statistics of the motion page cache (CACH command)
+void motionCacheReport(void);
+
+// Top level motion task called from the main loop
+// Executes one step of the current motion page whenever the previous step
+// has finished and takes care of the transitions between motion pages
+// (repeats, NextPage, ExitPage and new commands)
+void executeMotionSequence(void);
+
+#endif /* MOTION_F_H_ */
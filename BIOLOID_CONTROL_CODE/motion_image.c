@@ -0,0 +1,264 @@
+/*
+ * motion_image.c - binary motion images uploaded over the serial port
+ *	into a spare Flash slot, replacing the compiled-in motion pages
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "global.h"
+#include "motion_image.h"
+#include "pose.h"
+#include "motion_f.h"
+#include "serial.h"
+#include "clock.h"
+
+#ifdef MOTION_IMAGE_UPLOAD
+
+// slot of the active image (0 = compiled-in motion pages, 1 = A, 2 = B)
+// a single EEPROM byte, so switching images is atomic
+uint8 EEMEM motion_image_slot_ee = 0;
+
+// Flash address of the active image (0 = none) and number of pages in it
+static uint32 image_base = 0;
+static uint8 image_pages = 0;
+
+// servo ranges of the active image for the pose output limiter
+static uint16 image_min_values[NUM_AX12_SERVOS];
+static uint16 image_max_values[NUM_AX12_SERVOS];
+
+// Flash address of an image slot
+static uint32 slotAddress(uint8 slot)
+{
+	return (slot == 1) ? MOTION_IMAGE_SLOT_A : MOTION_IMAGE_SLOT_B;
+}
+
+// check an image header (from RAM)
+// Returns	(uint32)	image length, 0 if the header is not valid for this robot
+static uint32 checkImageHeader(const uint8 *header)
+{
+	uint32 length;
+
+	if( header[0] != MOTION_IMAGE_MAGIC0 || header[1] != MOTION_IMAGE_MAGIC1 || header[2] != MOTION_IMAGE_MAGIC2 ||
+		header[MOTION_IMAGE_OFS_VERSION] != MOTION_IMAGE_VERSION ||
+		header[MOTION_IMAGE_OFS_SERVOS] != NUM_AX12_SERVOS ) {
+		return 0;
+	}
+	length = (uint32) header[MOTION_IMAGE_OFS_LENGTH] | ((uint32) header[MOTION_IMAGE_OFS_LENGTH+1] << 8) |
+			((uint32) header[MOTION_IMAGE_OFS_LENGTH+2] << 16) | ((uint32) header[MOTION_IMAGE_OFS_LENGTH+3] << 24);
+	if( length <= MOTION_IMAGE_HEADER_SIZE || length > MOTION_IMAGE_SLOT_SIZE ) {
+		return 0;
+	}
+	return length;
+}
+
+// check the header and CRC of the image in a Flash slot
+// Returns	(uint32)	image length, 0 if there is no valid image
+static uint32 checkImage(uint32 base)
+{
+	uint8 header[MOTION_IMAGE_HEADER_SIZE];
+	uint32 length, i;
+	uint16 crc = 0xFFFF;
+
+	for (i=0; i<MOTION_IMAGE_HEADER_SIZE; i++) {
+		header[i] = pgm_read_byte_far(base + i);
+	}
+	length = checkImageHeader(header);
+	if( length == 0 ) {
+		return 0;
+	}
+	for (i=MOTION_IMAGE_HEADER_SIZE; i<length; i++) {
+		crc = _crc16_update(crc, pgm_read_byte_far(base + i));
+	}
+	if( crc != (header[MOTION_IMAGE_OFS_CRC] | (header[MOTION_IMAGE_OFS_CRC+1] << 8)) ) {
+		return 0;
+	}
+	return length;
+}
+
+// make the (checked) image in a slot the active one
+static void activateImage(uint8 slot)
+{
+	uint32 base = slotAddress(slot);
+	uint32 address = base + MOTION_IMAGE_HEADER_SIZE;
+
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++) {
+		image_min_values[i] = pgm_read_word_far(address);
+		address += 2;
+	}
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++) {
+		image_max_values[i] = pgm_read_word_far(address);
+		address += 2;
+	}
+	image_pages = pgm_read_byte_far(base + MOTION_IMAGE_OFS_PAGES);
+	image_base = base;
+	setPoseLimits(image_min_values, image_max_values);
+	motionPrefetchInvalidate();
+}
+
+// check for a valid image in the slot selected in EEPROM and make it active
+void motionImageInit(void)
+{
+	uint8 slot = eeprom_read_byte(&motion_image_slot_ee);
+
+	image_base = 0;
+	if( (slot == 1 || slot == 2) && checkImage(slotAddress(slot)) != 0 ) {
+		activateImage(slot);
+		printf_P(PSTR("\nMotion image %i active - %i pages\n"), slot, image_pages);
+	}
+}
+
+// Returns	(bool)	TRUE if the motion pages come from an uploaded image
+bool motionImageActive(void)
+{
+	return image_base != 0;
+}
+
+// find a motion page in the active image
+// Returns	(uint32)	Flash address of the page, 0 if the page does not exist
+uint32 motionImagePageAddress(uint8 page)
+{
+	uint32 address;
+
+	if( image_base == 0 || page == 0 ) {
+		return 0;
+	}
+	address = image_base + MOTION_IMAGE_HEADER_SIZE + 4*NUM_AX12_SERVOS;
+	for (uint8 i=0; i<image_pages; i++) {
+		if( pgm_read_byte_far(address) == page ) {
+			return image_base + pgm_read_word_far(address + 1);
+		}
+		address += 3;
+	}
+	return 0;
+}
+
+// Erase and write one Flash page. SPM only works from the boot section, so this
+// function has to be linked there (-Wl,--section-start=.bootloader=0x3E000).
+BOOTLOADER_SECTION static void writeFlashPage(uint32 address, const uint8 *data)
+{
+	uint8 sreg = SREG;
+	uint16 word;
+
+	cli();
+	eeprom_busy_wait();
+	boot_page_erase(address);
+	boot_spm_busy_wait();
+	for (uint16 i=0; i<SPM_PAGESIZE; i+=2) {
+		word = data[i] | (data[i+1] << 8);
+		boot_page_fill(address + i, word);
+	}
+	boot_page_write(address);
+	boot_spm_busy_wait();
+	boot_rww_enable();
+	SREG = sreg;
+}
+
+// receive a byte of the image, waiting up to MOTION_IMAGE_TIMEOUT ms
+// Returns	(int16)	  byte received or -1 on timeout
+static int16 receiveImageByte(void)
+{
+	unsigned long start = millis();
+	unsigned char c;
+
+	while( serial_read(&c, 1) == 0 ) {
+		if( millis() - start > MOTION_IMAGE_TIMEOUT ) {
+			return -1;
+		}
+	}
+	return c;
+}
+
+// send a single protocol byte to the host
+static void sendImageReply(uint8 reply)
+{
+	serial_write(&reply, 1);
+}
+
+// Receive a motion image over the serial port into the unused slot, check it
+// and make it active. Blocks the main loop until the upload is done.
+// Returns	(int)	  -1  - timeout, invalid image or CRC error
+//					   0  - new image active
+int motionImageReceive(void)
+{
+	uint8 buffer[SPM_PAGESIZE];
+	uint8 slot;
+	uint32 base, length = 0, received = 0, address;
+	int16 c;
+
+	// the currently active image stays untouched until the new one checks out
+	slot = (eeprom_read_byte(&motion_image_slot_ee) == 1) ? 2 : 1;
+	base = slotAddress(slot);
+	address = base;
+
+	printf_P(PSTR("\nLOAD - waiting for motion image (slot %i)\n"), slot);
+	serial_set_raw_mode(TRUE);
+	sendImageReply(MOTION_IMAGE_ACK);
+
+	do
+	{
+		// fill one Flash page, padding the last one
+		for (uint16 i=0; i<SPM_PAGESIZE; i++)
+		{
+			if( length != 0 && received >= length ) {
+				buffer[i] = 0xFF;
+				continue;
+			}
+			c = receiveImageByte();
+			if( c < 0 ) {
+				sendImageReply(MOTION_IMAGE_NAK);
+				serial_set_raw_mode(FALSE);
+				printf_P(PSTR("\nLOAD - timeout after %lu bytes\n> "), (unsigned long) received);
+				return -1;
+			}
+			buffer[i] = (uint8) c;
+			received++;
+			// check the header before anything is written
+			if( received == MOTION_IMAGE_HEADER_SIZE ) {
+				length = checkImageHeader(buffer);
+				if( length == 0 ) {
+					sendImageReply(MOTION_IMAGE_NAK);
+					serial_set_raw_mode(FALSE);
+					printf_P(PSTR("\nLOAD - invalid image header\n> "));
+					return -1;
+				}
+			}
+		}
+		writeFlashPage(address, buffer);
+		address += SPM_PAGESIZE;
+		sendImageReply(MOTION_IMAGE_ACK);
+	} while( received < length );
+
+	// read back the whole image before switching over to it
+	if( checkImage(base) != length ) {
+		sendImageReply(MOTION_IMAGE_NAK);
+		serial_set_raw_mode(FALSE);
+		printf_P(PSTR("\nLOAD - CRC error, image not activated\n> "));
+		return -1;
+	}
+	eeprom_update_byte(&motion_image_slot_ee, slot);
+	activateImage(slot);
+	sendImageReply(MOTION_IMAGE_ACK);
+	serial_set_raw_mode(FALSE);
+	printf_P(PSTR("\nLOAD - motion image %i active - %i pages\n> "), slot, image_pages);
+	return 0;
+}
+
+#endif
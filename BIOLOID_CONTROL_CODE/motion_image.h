@@ -0,0 +1,73 @@
+/*
+ * motion_image.h - binary motion images uploaded over the serial port
+ *	into a spare Flash slot, replacing the compiled-in motion pages
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MOTION_IMAGE_H_
+#define MOTION_IMAGE_H_
+
+// Motion image layout (written by MotionParser.pl -b, all values little endian)
+//   header		16 bytes, see offsets below
+//   limits		min and max value of each servo (2 x NUM_AX12_SERVOS uint16)
+//   index		one entry per page: page number (uint8), offset from image start (uint16)
+//   pages		delta encoded pages, same layout as MotionParser.pl -d
+// The CRC covers everything after the header.
+#define MOTION_IMAGE_MAGIC0			'B'
+#define MOTION_IMAGE_MAGIC1			'M'
+#define MOTION_IMAGE_MAGIC2			'I'
+#define MOTION_IMAGE_VERSION		3		// 3 - prescaled times, step times and speeds
+#define MOTION_IMAGE_HEADER_SIZE	16
+#define MOTION_IMAGE_OFS_VERSION	3		// uint8
+#define MOTION_IMAGE_OFS_SERVOS		4		// uint8 number of servos
+#define MOTION_IMAGE_OFS_PAGES		5		// uint8 number of pages in the index
+#define MOTION_IMAGE_OFS_LENGTH		8		// uint32 total image length including header
+#define MOTION_IMAGE_OFS_CRC		12		// uint16 CRC16 (avr-libc _crc16_update, init 0xFFFF)
+
+// Two Flash slots for images, the upload always goes to the slot not in use.
+// They sit above the application and below the boot section (0x3E000), linking
+// with motion_image.ld makes sure the application ends below slot A.
+#define MOTION_IMAGE_SLOT_A			0x20000UL
+#define MOTION_IMAGE_SLOT_B			0x2F000UL
+#define MOTION_IMAGE_SLOT_SIZE		0xF000UL
+
+#if MOTION_IMAGE_SLOT_A != 0x20000UL
+#error "MOTION_IMAGE_SLOT_A changed - update the ASSERT in motion_image.ld"
+#endif
+
+// upload protocol: the host sends the image in SPM_PAGESIZE blocks and
+// waits for an ACK after each block, the final ACK/NAK reports the swap
+#define MOTION_IMAGE_ACK			0x06
+#define MOTION_IMAGE_NAK			0x15
+#define MOTION_IMAGE_TIMEOUT		2000	// ms without a byte before the upload is aborted
+
+// check for a valid image in the slot selected in EEPROM and make it active
+void motionImageInit(void);
+
+// Returns	(bool)	TRUE if the motion pages come from an uploaded image
+bool motionImageActive(void);
+
+// find a motion page in the active image
+// Returns	(uint32)	Flash address of the page, 0 if the page does not exist
+uint32 motionImagePageAddress(uint8 page);
+
+// Receive a motion image over the serial port into the unused slot, check it
+// and make it active. Blocks the main loop until the upload is done.
+// Returns	(int)	  -1  - timeout, invalid image or CRC error
+//					   0  - new image active
+int motionImageReceive(void);
+
+#endif /* MOTION_IMAGE_H_ */
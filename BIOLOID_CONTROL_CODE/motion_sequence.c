@@ -0,0 +1,110 @@
+/*
+ * motion_sequence.c - combo sequences of motion pages started with
+ *	a single command (C#), with repeat counts and sensor guards
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <avr/pgmspace.h>
+#include "global.h"
+#include "motion_sequence.h"
+#include "motion_f.h"
+
+// sensor values updated by adc_processSensorData()
+extern volatile int16 adc_accelx;
+extern volatile int16 adc_accely;
+extern volatile uint16 adc_dms_distance;
+
+// The sequence table, sequence n is started with the command Cn.
+// Unused entries are 0 (page 0 ends the sequence). The sequence replaces
+// the NextPage of its pages, after the last entry NextPage applies again.
+const motionSequenceEntry MOTION_SEQUENCES[][MAX_SEQUENCE_ENTRIES] PROGMEM = {
+	// 0: guard, jab, jab, retreat - only jab while the opponent is within reach
+	{ {COMBO_GUARD_MP, 1, MOTION_GUARD_NONE, 0},
+	  {COMBO_JAB_MP, 1, MOTION_GUARD_NEAR | MOTION_GUARD_SKIP, COMBO_REACH},
+	  {COMBO_JAB_MP, 1, MOTION_GUARD_NEAR | MOTION_GUARD_SKIP, COMBO_REACH},
+	  {COMBO_RETREAT_MP, 1, MOTION_GUARD_NONE, 0} },
+	// 1: two jabs as long as the robot stands upright
+	{ {COMBO_JAB_MP, 2, MOTION_GUARD_UPRIGHT, 50},
+	  {COMBO_GUARD_MP, 1, MOTION_GUARD_NONE, 0} },
+};
+
+#define NUM_MOTION_SEQUENCES	(sizeof(MOTION_SEQUENCES) / sizeof(MOTION_SEQUENCES[0]))
+
+// Returns	(uint8)	number of sequences in the table
+uint8 motionSequenceCount(void)
+{
+	return NUM_MOTION_SEQUENCES;
+}
+
+// read an entry of a sequence from Flash
+// Returns	(bool)	FALSE if the sequence has no more entries
+bool motionSequenceGetEntry(uint8 sequence, uint8 index, motionSequenceEntry *entry)
+{
+	if( sequence >= NUM_MOTION_SEQUENCES || index >= MAX_SEQUENCE_ENTRIES ) {
+		return FALSE;
+	}
+	memcpy_PF(entry, pgm_get_far_address(MOTION_SEQUENCES) +
+			(sequence * MAX_SEQUENCE_ENTRIES + index) * sizeof(motionSequenceEntry), sizeof(motionSequenceEntry));
+	return (entry->Page != 0);
+}
+
+// Returns	(bool)	TRUE if the guard of the entry holds with the latest sensor values
+bool motionSequenceGuard(const motionSequenceEntry *entry)
+{
+	int16 limit = (int16) entry->GuardValue * 10;
+
+	switch( entry->Guard & ~MOTION_GUARD_SKIP )
+	{
+		case MOTION_GUARD_NEAR:
+			return adc_dms_distance < entry->GuardValue;
+		case MOTION_GUARD_FAR:
+			return adc_dms_distance > entry->GuardValue;
+		case MOTION_GUARD_UPRIGHT:
+			return adc_accelx > -limit && adc_accelx < limit && adc_accely > -limit && adc_accely < limit;
+	}
+	return TRUE;
+}
+
+// check that a sequence exists and all its pages and guards are valid
+// (done when the command arrives, so a bad sequence never starts moving)
+// Returns	(int)	  -1  - sequence can't be played
+//					   0  - all ok
+int motionSequenceCheck(uint8 sequence)
+{
+	motionSequenceEntry entry;
+	uint8 i;
+
+	if( sequence >= NUM_MOTION_SEQUENCES ) {
+		printf_P(PSTR("\nmotionSequenceCheck - no sequence %i\n"), sequence);
+		return -1;
+	}
+	for (i=0; motionSequenceGetEntry(sequence, i, &entry); i++)
+	{
+		if( !motionPageExists(entry.Page) ) {
+			printf_P(PSTR("\nmotionSequenceCheck - sequence %i entry %i: page %i does not exist\n"), sequence, i, entry.Page);
+			return -1;
+		}
+		if( (entry.Guard & ~MOTION_GUARD_SKIP) > MOTION_GUARD_UPRIGHT ) {
+			printf_P(PSTR("\nmotionSequenceCheck - sequence %i entry %i: unknown guard %i\n"), sequence, i, entry.Guard);
+			return -1;
+		}
+	}
+	if( i == 0 ) {
+		printf_P(PSTR("\nmotionSequenceCheck - sequence %i is empty\n"), sequence);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * motion_sequence.h - combo sequences of motion pages started with
+ *	a single command (C#), with repeat counts and sensor guards
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MOTION_SEQUENCE_H_
+#define MOTION_SEQUENCE_H_
+
+// no sequence running
+#define MOTION_SEQUENCE_NONE	0xFF
+
+// Guards are checked just before an entry starts. If the guard does not hold
+// the sequence ends via the exit page of the current page, unless
+// MOTION_GUARD_SKIP is set - then only this entry is left out.
+#define MOTION_GUARD_NONE		0
+#define MOTION_GUARD_NEAR		1		// DMS distance below GuardValue cm
+#define MOTION_GUARD_FAR		2		// DMS distance above GuardValue cm
+#define MOTION_GUARD_UPRIGHT	3		// both accelerations below GuardValue*10 mg
+#define MOTION_GUARD_SKIP		0x80
+
+// one entry of a sequence as stored in Flash
+typedef struct
+{
+	uint8  Page;			// motion page, 0 ends the sequence
+	uint8  Repeat;			// times to play the page, 0 = RepeatTime of the page
+	uint8  Guard;			// MOTION_GUARD_xxx, optionally with MOTION_GUARD_SKIP
+	uint8  GuardValue;
+} motionSequenceEntry;
+
+// Returns	(uint8)	number of sequences in the table
+uint8 motionSequenceCount(void);
+
+// read an entry of a sequence from Flash
+// Returns	(bool)	FALSE if the sequence has no more entries
+bool motionSequenceGetEntry(uint8 sequence, uint8 index, motionSequenceEntry *entry);
+
+// Returns	(bool)	TRUE if the guard of the entry holds with the latest sensor values
+bool motionSequenceGuard(const motionSequenceEntry *entry);
+
+// check that a sequence exists and all its pages and guards are valid
+// Returns	(int)	  -1  - sequence can't be played
+//					   0  - all ok
+int motionSequenceCheck(uint8 sequence);
+
+#endif /* MOTION_SEQUENCE_H_ */
@@ -20,28 +20,55 @@
 
 #include <util/delay.h>
 #include <stdio.h>
+#include <avr/pgmspace.h>
 #include "global.h"
 #include "pose.h"
 #include "dynamixel.h"
 #include "clock.h"
+#include "profile.h"
+#include "latency.h"
 #include "walk.h"
+#include "scheduler.h"
 
 // global hardware definition variables
 extern const uint8 AX12Servos[MAX_AX12_SERVOS]; 
 extern const uint8 AX12_IDS[NUM_AX12_SERVOS];
-// should keep the current pose in a global array
-extern volatile int16 current_pose[NUM_AX12_SERVOS];
-// joint offset values
-extern volatile int16 joint_offset[NUM_AX12_SERVOS];
+// should keep the current pose in a global array (double-buffered)
+extern int16 current_pose_frame[2][NUM_AX12_SERVOS];
+extern volatile uint8 current_pose_front;
+// joint offset values (double-buffered)
+extern int16 joint_offset_frame[2][NUM_AX12_SERVOS];
+extern volatile uint8 joint_offset_front;
+// joints that receive gyro balance offsets (see adc.c)
+extern const uint8 adc_balance_joints[NUM_BALANCE_JOINTS];
 
 // initial robot position (MotionPage 224 - Balance)
 const uint16 InitialValues[NUM_AX12_SERVOS] = {235,788,279,744,462,561,358,666,507,516,341,682,240,783,647,376,507,516}; 
 const uint16 InitialPlayTime = 400; // 0.4s is fast enough
 
-// we keep shared variables for goal pose and speed
-uint16 goal_pose[NUM_AX12_SERVOS];
-uint16 goal_speed[NUM_AX12_SERVOS];
-uint16 last_goal[NUM_AX12_SERVOS];
+// we keep shared variables for goal pose and speed (double-buffered)
+// calculatePoseServoSpeeds fills the back frame, the sync write uses the front
+uint16 goal_pose_frame[2][NUM_AX12_SERVOS];
+uint16 goal_speed_frame[2][NUM_AX12_SERVOS];
+volatile uint8 goal_front = 0;
+// joint offsets as passed by the limiter, their rate of change (per 100ms)
+// and when they were limited last (scheduler_now(), low 16 bits)
+static int16 limited_offset[NUM_AX12_SERVOS];
+static int16 limited_offset_rate[NUM_AX12_SERVOS];
+static uint16 limited_offset_time[NUM_AX12_SERVOS];
+// servo position limits (SERVO_MIN_VALUES/SERVO_MAX_VALUES from motion.h)
+static const uint16 *servo_min_values = NULL;
+static const uint16 *servo_max_values = NULL;
+// number of goals clamped by each stage of the output limiter
+static uint32 pose_limit_counts[POSE_LIMIT_STAGES];
+// goal pose of the current step before joint offsets are applied
+uint16 base_goal[NUM_AX12_SERVOS];
+// flag that base_goal holds a valid step trajectory for balance corrections
+static uint8 base_goal_valid = 0;
+// step timing mode, effective step time and bottleneck joint of the last pose move
+static uint8 pose_timing_mode = POSE_TIMING_DEFAULT;
+static uint16 pose_step_time = 0;
+static uint8 pose_bottleneck_joint = 0;
 
 
 // the new implementation of AVR libc does not allow variables passed to _delay_ms
@@ -51,13 +78,42 @@ static inline void delay_ms(uint8 count) {
 	} 
 }
 
+// Double-buffered frame access
+// A producer fills the back frame completely and then publishes it by 
+// swapping the front index. A consumer takes the front frame once and has to
+// be done with it before the producer's next update (one sensor period).
+// Returns	(int16*)  pointer to the frame
+const int16 * getJointOffsetFrame()
+{
+	return joint_offset_frame[joint_offset_front];
+}
+
+int16 * getJointOffsetBackFrame()
+{
+	return joint_offset_frame[joint_offset_front ^ 1];
+}
+
+void publishJointOffsets()
+{
+	joint_offset_front ^= 1;
+}
+
+const int16 * getCurrentPoseFrame()
+{
+	return current_pose_frame[current_pose_front];
+}
+
 // read in current servo positions to determine current pose
 void readCurrentPose()
 {
+	int16 *pose = current_pose_frame[current_pose_front ^ 1];
+	
 	// loop over all possible actuators
 	for(int i=0; i<NUM_AX12_SERVOS; i++) {
-		current_pose[i] = dxl_read_word( AX12_IDS[i], DXL_PRESENT_POSITION_L );
+		pose[i] = dxl_read_word( AX12_IDS[i], DXL_PRESENT_POSITION_L );
 	}
+	// publish the complete pose
+	current_pose_front ^= 1;
 }
 
 // Function to wait out any existing servo movement
@@ -65,6 +121,7 @@ void waitForPoseFinish()
 {
 	uint8 still_moving[NUM_AX12_SERVOS], moving_flag = 0;
 	uint8 first_loop = 0;
+	PROFILE_START(PROFILE_WAIT_POSE);
 	
 	first_loop = 0;
 	// keep looping over all possible actuators until done
@@ -82,6 +139,134 @@ void waitForPoseFinish()
 		}
 		first_loop = 1;
 	} while (moving_flag > 0);
+	PROFILE_END(PROFILE_WAIT_POSE);
+}
+
+// Set the servo position limits used by the output limiter
+// Inputs:	(uint16)  arrays of minimum and maximum position per servo 
+//					  (SERVO_MIN_VALUES/SERVO_MAX_VALUES from motion.h)
+void setPoseLimits(const uint16 *min_values, const uint16 *max_values)
+{
+	servo_min_values = min_values;
+	servo_max_values = max_values;
+}
+
+// limit a single joint goal to the position bounds of the servo
+// Returns	(int16)	  limited goal position
+static int16 limitJointPosition(uint8 i, int16 value)
+{
+	int16 lower = 0, upper = 1023;
+	
+	// widen the range of the motion file by the margin for balance corrections
+	if( servo_min_values != NULL ) {
+		lower = (int16) servo_min_values[i] - POSE_LIMIT_MARGIN;
+		upper = (int16) servo_max_values[i] + POSE_LIMIT_MARGIN;
+		if( lower < 0 ) lower = 0;
+		if( upper > 1023 ) upper = 1023;
+	}
+	if( value < lower ) {
+		pose_limit_counts[POSE_LIMIT_POSITION]++;
+		return lower;
+	} else if( value > upper ) {
+		pose_limit_counts[POSE_LIMIT_POSITION]++;
+		return upper;
+	}
+	return value;
+}
+
+// limit the change of a joint offset to POSE_MAX_OFFSET_RATE and the change
+// of that rate to POSE_MAX_OFFSET_ACCEL, both per 100ms of the time since the
+// offset of the joint was limited last (steps and balance corrections alike)
+// Returns	(int16)	  limited joint offset
+static int16 limitJointOffset(uint8 i, int16 offset, uint16 now)
+{
+	uint16 dt = now - limited_offset_time[i];
+	int32 delta, max_delta, rate, base, max_change;
+
+	if( dt == 0 ) {
+		return limited_offset[i];
+	}
+	// after a pause the limits are those of 100ms
+	if( dt > 100 ) {
+		dt = 100;
+	}
+	limited_offset_time[i] = now;
+
+	// rate limit
+	delta = offset - limited_offset[i];
+	max_delta = (int32) POSE_MAX_OFFSET_RATE * dt / 100;
+	if( delta > max_delta ) {
+		delta = max_delta;
+		pose_limit_counts[POSE_LIMIT_RATE]++;
+	} else if( delta < -max_delta ) {
+		delta = -max_delta;
+		pose_limit_counts[POSE_LIMIT_RATE]++;
+	}
+	// acceleration limit on the rate per 100ms, only for speeding up (slowing
+	// down or stopping is always allowed, so the offset never overshoots)
+	rate = delta * 100 / dt;
+	max_change = (int32) POSE_MAX_OFFSET_ACCEL * dt / 100;
+	base = limited_offset_rate[i];
+	if( rate > 0 ) {
+		if( base < 0 ) base = 0;
+		if( rate > base + max_change ) {
+			rate = base + max_change;
+			delta = (rate * dt + 50) / 100;
+			pose_limit_counts[POSE_LIMIT_ACCEL]++;
+		}
+	} else if( rate < 0 ) {
+		if( base > 0 ) base = 0;
+		if( rate < base - max_change ) {
+			rate = base - max_change;
+			delta = (rate * dt - 50) / 100;
+			pose_limit_counts[POSE_LIMIT_ACCEL]++;
+		}
+	}
+	limited_offset_rate[i] = rate;
+	limited_offset[i] += delta;
+	return limited_offset[i];
+}
+
+// limit the goal of a joint: the rate and acceleration limits apply to the
+// offset, the authored step goal stays as it is, the position bounds to both
+// Returns	(int16)	  limited goal position
+static int16 limitJointOutput(uint8 i, uint16 goal, int16 offset, uint16 now)
+{
+	return limitJointPosition(i, (int16) goal + limitJointOffset(i, offset, now));
+}
+
+// Output limiter - runs over the whole pose in a single pass before the sync write
+// The joint offsets are limited in rate and acceleration (per time, so the
+// same holds for short and long steps), the step goal plus the limited
+// offset is then held to the servo position bounds. The authored goals are
+// left alone, so they still match the precomputed step times and speeds.
+// Inputs:	(uint16)  step goal positions
+//			(int16)   joint offsets
+// Output:	(uint16)  limited goal positions
+void limitPoseOutput(const uint16 goal[], const int16 offset[], uint16 out[])
+{
+	uint16 now = (uint16) scheduler_now();
+
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++)
+	{
+		out[i] = (uint16) limitJointOutput(i, goal[i], offset[i], now);
+	}
+}
+
+// Returns	(uint32)  number of goals clamped by the given limiter stage
+//					  (POSE_LIMIT_POSITION, POSE_LIMIT_RATE, POSE_LIMIT_ACCEL)
+uint32 getPoseLimitCount(uint8 stage)
+{
+	return pose_limit_counts[stage];
+}
+
+// print the clamp counts of the output limiter stages (LIMT command)
+void poseLimitReport()
+{
+	printf_P(PSTR("\nLimiter clamps - position %lu, offset rate %lu, offset accel %lu\n> "),
+			(unsigned long) pose_limit_counts[POSE_LIMIT_POSITION],
+			(unsigned long) pose_limit_counts[POSE_LIMIT_RATE],
+			(unsigned long) pose_limit_counts[POSE_LIMIT_ACCEL]);
 }
 
 // Calculate servo speeds to achieve desired pose timing
@@ -90,53 +275,77 @@ void waitForPoseFinish()
 // The AX-12 manual states this as the 'no load speed' at 12V
 // The Moving Speed control table entry states that 0x3FF = 114rpm
 // and according to Robotis this means 0x212 = 59rpm and anything greater 0x212 is also 59rpm
-void calculatePoseServoSpeeds(uint16 time)
+// If the joint with the most travel (bottleneck joint) cannot make the step
+// time even at maximum speed, the step is stretched to the fastest feasible
+// time and all speeds are calculated for that time so all joints finish together.
+// In POSE_TIMING_FASTEST mode every step is compressed to that time.
+// Returns	(uint16)  effective step time in ms
+uint16 calculatePoseServoSpeeds(uint16 time)
 {
     int i;
-	uint16 travel[NUM_AX12_SERVOS], temp_goal;
+	uint16 travel[NUM_AX12_SERVOS], max_travel = 0, min_time;
 	uint32 factor;
+	const int16 *current_pose, *joint_offset;
+	int16 *next_pose;
+	uint16 *goal_pose, *goal_speed;
 
 	// read the current pose only if we are not walking (no time)
 	if( walk_getWalkState() == 0 ) {
 		readCurrentPose();		// takes 6ms
 	}	
 	
+	// take consistent snapshots of pose and offsets, and fill the back goal frame
+	current_pose = getCurrentPoseFrame();
+	next_pose = current_pose_frame[current_pose_front ^ 1];
+	joint_offset = getJointOffsetFrame();
+	goal_pose = goal_pose_frame[goal_front ^ 1];
+	goal_speed = goal_speed_frame[goal_front ^ 1];
+	
+	// process the joint offset values and limit the resulting goals
+	limitPoseOutput(base_goal, joint_offset, goal_pose);
+	
 	// TEST: printf("\nCalculate Pose Speeds. Time = %i \n", time);
 	// determine travel for each servo 
 	for (i=0; i<NUM_AX12_SERVOS; i++)
 	{
-		// TEST: printf("\nDXL%i Current, Goal, Travel, Speed:", i+1);
-		
-		// process the joint offset values bearing in mind the different variable types
-		temp_goal = (int16) goal_pose[i] + joint_offset[i];
-		if ( temp_goal < 0 ) { 
-			goal_pose[i] = 0;		// can't go below 0
-		} 
-		else if ( temp_goal > 1023 ) {
-			goal_pose[i] = 1023;	// or above 1023
-		}
-		else {
-			goal_pose[i] = (uint16) temp_goal;
-		}
-		
 		// find the amount of travel for each servo
 		if( goal_pose[i] > current_pose[i]) {
 			travel[i] = goal_pose[i] - current_pose[i];
 		} else {
 			travel[i] = current_pose[i] - goal_pose[i];
 		}
+		// and keep track of the bottleneck joint
+		if( travel[i] > max_travel ) {
+			max_travel = travel[i];
+			pose_bottleneck_joint = i;
+		}
 		
 		// if we are walking we simply set the current pose as the goal pose to save time
-		if( walk_getWalkState() != 0 ) {
-			current_pose[i] = goal_pose[i];	
-		}		
+		next_pose[i] = goal_pose[i];
+	}
+	if( walk_getWalkState() != 0 ) {
+		current_pose_front ^= 1;
+	}
 	
+	// fastest feasible time is the bottleneck joint moving at maximum speed (rounded up)
+	min_time = (uint16) (((uint32) 848 * max_travel + 1022) / 1023);
+	if( pose_timing_mode == POSE_TIMING_FASTEST || time < min_time ) {
+		time = min_time;
+	}
+	if( time == 0 ) {
+		time = 1;				// nothing moves, but avoid dividing by zero
+	}
+	
+	for (i=0; i<NUM_AX12_SERVOS; i++)
+	{
+		// TEST: printf("\nDXL%i Current, Goal, Travel, Speed:", i+1);
+		
 		// now we can calculate the desired moving speed
 		// for 59pm the factor is 847.46 which we round to 848
 		// we need to use a temporary 32bit integer to prevent overflow
 		factor = (uint32) 848 * travel[i]; 
 		goal_speed[i] = (uint16) ( factor / time );
-		// if the desired speed exceeds the maximum, we need to adjust
+		// the step time already allows for the maximum, but just in case
 		if (goal_speed[i] > 1023) goal_speed[i] = 1023;
 		// we also use a minimum speed of 26 (5% of 530 the max value for 59RPM)
 		if (goal_speed[i] < 26) goal_speed[i] = 26;
@@ -144,40 +353,60 @@ void calculatePoseServoSpeeds(uint16 time)
 		// TEST: printf(" %u, %u, %u, %u", current_pose[i], goal_pose[i], travel[i], goal_speed[i]);
 	}
 	
+	// publish the new goal frame
+	goal_front ^= 1;
+	return time;
 }
 
+// Set how calculatePoseServoSpeeds deals with the requested step time
+// Input:	POSE_TIMING_AS_AUTHORED - keep step time unless infeasible
+//			POSE_TIMING_FASTEST - compress all steps to the fastest feasible time
+void setPoseTimingMode(uint8 mode)
+{
+	pose_timing_mode = mode;
+}
 
-// Moves from the current pose to the goal pose
-// using calculated servo speeds and delay between steps
-// to achieve the required step timing
-// Inputs:  (uint16)  allocated step time in ms
-//          (uint16)  array of goal positions for the actuators
-//          (uint8)   flag = 0 don't wait for motion to finish
-//					  flag = 1 wait for motion to finish and check alarms
+// Returns	(uint8)	  current step timing mode
+uint8 getPoseTimingMode()
+{
+	return pose_timing_mode;
+}
+
+// Returns	(uint16)  effective step time in ms of the last pose move
+uint16 getPoseStepTime()
+{
+	return pose_step_time;
+}
+
+// Returns	(uint8)	  index of the bottleneck joint of the last pose move
+uint8 getPoseBottleneckJoint()
+{
+	return pose_bottleneck_joint;
+}
+
+
+// Write the front goal frame to the servos via sync write and optionally
+// wait for the movement to finish
 // Returns	(int)	  -1  - communication error
 //					   0  - all ok
 //					   1  - alarm
-int moveToGoalPose(uint16 time, uint16 goal[], uint8 wait_flag)
+static int writeGoalPose(uint8 wait_flag)
 {
     int i;
 	int commStatus, errorStatus;
 
-	// copy goal to shared variable
-	for (i=0; i<NUM_AX12_SERVOS; i++)
-		{ goal_pose[i] = goal[i]; }
-
-	// do the setup and calculate speeds
-	calculatePoseServoSpeeds(time);
-
 	// write out the goal positions via sync write
-	commStatus = dxl_set_goal_speed(NUM_AX12_SERVOS, AX12_IDS, goal_pose, goal_speed);
+	PROFILE_START(PROFILE_SYNC_WRITE);
+	commStatus = dxl_set_goal_speed(NUM_AX12_SERVOS, AX12_IDS, goal_pose_frame[goal_front], goal_speed_frame[goal_front]);
+	PROFILE_END(PROFILE_SYNC_WRITE);
 	// check for communication error or timeout
 	if(commStatus != COMM_RXSUCCESS) {
 		// there has been an error, print and break
-		printf("\nmoveToGoalPose - ");
+		printf_P(PSTR("\nwriteGoalPose - "));
 		dxl_printCommStatus(commStatus);
 		return -1;
 	}
+	latency_poseWritten();
 
 	// only wait for pose to finish if requested to do so
 	if( wait_flag == 1 )
@@ -191,8 +420,8 @@ int moveToGoalPose(uint16 time, uint16 goal[], uint8 wait_flag)
 			errorStatus = dxl_ping(AX12_IDS[i]);
 			if(errorStatus != 0) {
 				// there has been an error, disable torque
-				commStatus = dxl_write_byte(BROADCAST_ID, DXL_TORQUE_ENABLE, 0);
-				printf("\nmoveToGoalPose Alarm ID%i - Error Code %i\n", AX12_IDS[i], errorStatus);
+				disablePoseTorque();
+				printf_P(PSTR("\nwriteGoalPose Alarm ID%i - Error Code %i\n"), AX12_IDS[i], errorStatus);
 				return 1;
 			}
 		}	
@@ -202,6 +431,144 @@ int moveToGoalPose(uint16 time, uint16 goal[], uint8 wait_flag)
 	return 0;
 }
 
+// Moves from the current pose to the goal pose
+// using calculated servo speeds and delay between steps
+// to achieve the required step timing
+// Inputs:  (uint16)  allocated step time in ms
+//          (uint16)  array of goal positions for the actuators
+//          (uint8)   flag = 0 don't wait for motion to finish
+//					  flag = 1 wait for motion to finish and check alarms
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+//					   1  - alarm
+int moveToGoalPose(uint16 time, uint16 goal[], uint8 wait_flag)
+{
+    int i;
+
+	// keep the uncorrected step goal
+	for (i=0; i<NUM_AX12_SERVOS; i++)
+		{ base_goal[i] = goal[i]; }
+	base_goal_valid = 1;
+
+	// do the setup and calculate speeds (may stretch or compress the step time)
+	pose_step_time = calculatePoseServoSpeeds(time);
+
+	// write out the goal positions and speeds
+	return writeGoalPose(wait_flag);
+}
+
+// Moves to the goal pose with the step time and servo speeds precomputed by
+// MotionParser.pl (for steps that start from the previous step of the page).
+// Skips reading the current pose and calculating the speeds, the goals still
+// go through the joint offsets and the output limiter.
+// Inputs:  (uint16)  effective step time in ms
+//          (uint16)  array of goal positions for the actuators
+//          (uint8)   array of servo speeds / 4 (rounded up)
+//          (uint8)   flag = 0 don't wait for motion to finish
+//					  flag = 1 wait for motion to finish and check alarms
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+//					   1  - alarm
+int moveToGoalPoseWithSpeeds(uint16 time, uint16 goal[], const uint8 speed[], uint8 wait_flag)
+{
+	int16 *next_pose = current_pose_frame[current_pose_front ^ 1];
+	uint16 *goal_pose = goal_pose_frame[goal_front ^ 1];
+	uint16 *goal_speed = goal_speed_frame[goal_front ^ 1];
+	uint16 max_speed = 0;
+
+	// keep the uncorrected step goal
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++)
+		{ base_goal[i] = goal[i]; }
+	base_goal_valid = 1;
+
+	limitPoseOutput(base_goal, getJointOffsetFrame(), goal_pose);
+	for (uint8 i=0; i<NUM_AX12_SERVOS; i++)
+	{
+		goal_speed[i] = (uint16) speed[i] << 2;
+		if (goal_speed[i] > 1023) goal_speed[i] = 1023;
+		if (goal_speed[i] < 26) goal_speed[i] = 26;
+		// the fastest joint is the bottleneck
+		if( goal_speed[i] > max_speed ) {
+			max_speed = goal_speed[i];
+			pose_bottleneck_joint = i;
+		}
+		// we don't read back the pose, the goal is the next current pose
+		next_pose[i] = goal_pose[i];
+	}
+	current_pose_front ^= 1;
+	goal_front ^= 1;
+	pose_step_time = time;
+
+	return writeGoalPose(wait_flag);
+}
+
+// Push the latest gyro joint offsets to the balance joints only
+// The new goal is the uncorrected step goal plus the current joint offset, so
+// the base step trajectory stays unchanged underneath the correction. The
+// offsets go through the output limiter like those of the steps. Only
+// joints whose corrected goal changed are written (goal position only, the
+// moving speed calculated for the step remains in place).
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok (or nothing to do)
+int applyBalanceCorrection()
+{
+	uint8 ids[NUM_BALANCE_JOINTS], count = 0, i;
+	int16 values[NUM_BALANCE_JOINTS], temp_goal;
+	int commStatus;
+	const int16 *joint_offset;
+	uint16 *goal_pose;
+	uint16 now = (uint16) scheduler_now();
+
+	// nothing to correct until the first pose has been commanded (or after
+	// the torque was switched off)
+	if( base_goal_valid == 0 ) {
+		return 0;
+	}
+	// latest complete offsets, corrected goals go straight into the front
+	// goal frame (same context as the step sync write)
+	joint_offset = getJointOffsetFrame();
+	goal_pose = goal_pose_frame[goal_front];
+
+	for (uint8 k=0; k<NUM_BALANCE_JOINTS; k++)
+	{
+		i = adc_balance_joints[k];
+		// offset on top of the step goal, through the same limiter state as the steps
+		temp_goal = limitJointOutput(i, base_goal[i], joint_offset[i], now);
+		// skip joints whose goal has not changed since the last write
+		if ( (uint16) temp_goal == goal_pose[i] ) {
+			continue;
+		}
+		goal_pose[i] = (uint16) temp_goal;
+		ids[count] = AX12_IDS[i];
+		values[count] = temp_goal;
+		count++;
+	}
+	
+	if( count == 0 ) {
+		return 0;
+	}
+
+	// write out the corrected goal positions via sync write
+	PROFILE_START(PROFILE_SYNC_WRITE);
+	commStatus = dxl_sync_write_word(count, DXL_GOAL_POSITION_L, ids, values);
+	PROFILE_END(PROFILE_SYNC_WRITE);
+	if(commStatus != COMM_RXSUCCESS) {
+		printf_P(PSTR("\napplyBalanceCorrection - "));
+		dxl_printCommStatus(commStatus);
+		return -1;
+	}
+	return 0;
+}
+
+// Switch the torque of all servos off (emergency stop or alarm). Balance
+// corrections stay off until the next pose is commanded, a goal write would
+// switch the torque back on.
+void disablePoseTorque()
+{
+	base_goal_valid = 0;
+	dxl_write_byte(BROADCAST_ID, DXL_TORQUE_ENABLE, 0);
+}
+
 // move robot to default pose
 void moveToDefaultPose()
 {
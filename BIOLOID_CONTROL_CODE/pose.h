@@ -26,19 +26,88 @@
 #define WAIT_FOR_POSE_FINISH		1
 #define DONT_WAIT_FOR_POSE_FINISH	0
 
-// read in current servo positions to the pose. 
+// Double-buffered pose and joint offset frames
+// Producers fill the back frame and publish it with an atomic index swap,
+// consumers always see the last complete front frame
+// Returns	pointer to the front (consumer) or back (producer) frame
+const int16 * getJointOffsetFrame(void);
+int16 * getJointOffsetBackFrame(void);
+const int16 * getCurrentPoseFrame(void);
+
+// make the back joint offset frame the front frame
+void publishJointOffsets(void);
+
+// read in current servo positions to the pose (publishes a new pose frame)
 void readCurrentPose();
 
 // Function to wait out any existing servo movement
 void waitForPoseFinish();
 
+// output limiter settings (in AX-12 position units, 1 unit = 0.29 deg)
+// The authored step goals are only held to the position bounds (their timing
+// and speeds are precomputed), the rate and acceleration limits apply to the
+// joint offsets (balance corrections) on top of them.
+#define POSE_LIMIT_MARGIN			16	// allowed beyond SERVO_MIN/MAX_VALUES of the motion file
+#define POSE_MAX_OFFSET_RATE		100	// maximum offset change per 100ms
+#define POSE_MAX_OFFSET_ACCEL		500	// maximum change of that rate per 100ms
+// output limiter stages (for getPoseLimitCount)
+#define POSE_LIMIT_POSITION			0
+#define POSE_LIMIT_RATE				1
+#define POSE_LIMIT_ACCEL			2
+#define POSE_LIMIT_STAGES			3
+
+// step timing modes for calculatePoseServoSpeeds
+#define POSE_TIMING_AS_AUTHORED		0	// keep the step time unless it is infeasible
+#define POSE_TIMING_FASTEST			1	// compress every step to the fastest feasible time
+#ifndef POSE_TIMING_DEFAULT
+  #define POSE_TIMING_DEFAULT		POSE_TIMING_AS_AUTHORED
+#endif
+
+// Set the servo position limits used by the output limiter
+// Inputs:	(uint16)  arrays of minimum and maximum position per servo 
+//					  (SERVO_MIN_VALUES/SERVO_MAX_VALUES from motion.h)
+void setPoseLimits(const uint16 *min_values, const uint16 *max_values);
+
+// Output limiter - applies the rate and acceleration limits to the joint
+// offsets and the position bounds to the goals over the whole pose before
+// the sync write
+// Inputs:	(uint16)  step goal positions
+//			(int16)   joint offsets
+// Output:	(uint16)  limited goal positions
+void limitPoseOutput(const uint16 goal[], const int16 offset[], uint16 out[]);
+
+// Returns	(uint32)  number of goals clamped by the given limiter stage
+//					  (POSE_LIMIT_POSITION, POSE_LIMIT_RATE, POSE_LIMIT_ACCEL)
+uint32 getPoseLimitCount(uint8 stage);
+
+// print the clamp counts of the output limiter stages (LIMT command)
+void poseLimitReport(void);
+
 // Calculate servo speeds to achieve desired pose timing
 // We make the following assumptions:
 // AX-12 speed is 59rpm @ 12V which corresponds to 0.170s/60deg
 // The AX-12 manual states this as the 'no load speed' at 12V
 // We ignore the Moving Speed entry which states that 0x3FF = 114rpm
 // Instead we assume that Moving Speed 0x3FF = 59rpm
-void calculatePoseServoSpeeds(uint16 time);
+// Steps that are too short for the bottleneck joint are stretched so that
+// all joints finish together (see also setPoseTimingMode)
+// Returns	(uint16)  effective step time in ms
+uint16 calculatePoseServoSpeeds(uint16 time);
+
+// Set how calculatePoseServoSpeeds deals with the requested step time
+// Input:	POSE_TIMING_AS_AUTHORED - keep step time unless infeasible
+//			POSE_TIMING_FASTEST - compress all steps to the fastest feasible 
+//								  time (fight moves, speed over fidelity)
+void setPoseTimingMode(uint8 mode);
+
+// Returns	(uint8)	  current step timing mode
+uint8 getPoseTimingMode(void);
+
+// Returns	(uint16)  effective step time in ms of the last moveToGoalPose
+uint16 getPoseStepTime(void);
+
+// Returns	(uint8)	  index of the bottleneck joint of the last moveToGoalPose
+uint8 getPoseBottleneckJoint(void);
 
 // Moves from the current pose to the goal pose
 // using calculated servo speeds and delay between steps
@@ -52,6 +121,30 @@ void calculatePoseServoSpeeds(uint16 time);
 //					   1  - alarm
 int moveToGoalPose(uint16 time, uint16 goal[], uint8 wait_flag);
 
+// Moves to the goal pose with the step time and servo speeds precomputed by
+// MotionParser.pl, for steps that start from the previous step of the page
+// (no pose read back and no speed calculation)
+// Inputs:  (uint16)  effective step time in ms
+//          (uint16)  array of goal positions for the actuators
+//          (uint8)   array of servo speeds / 4 (rounded up)
+//          (uint8)   flag = 0 don't wait, flag = 1 wait and check alarms
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok
+//					   1  - alarm
+int moveToGoalPoseWithSpeeds(uint16 time, uint16 goal[], const uint8 speed[], uint8 wait_flag);
+
+// Push the latest gyro joint offsets to the balance joints only (knees, 
+// ankles, hips) via a small sync write, on top of the current step goal
+// Call after each new gyro sample has been processed
+// Returns	(int)	  -1  - communication error
+//					   0  - all ok (or nothing to do)
+int applyBalanceCorrection(void);
+
+// Switch the torque of all servos off (emergency stop or alarm). Balance
+// corrections stay off until the next pose is commanded, a goal write would
+// switch the torque back on.
+void disablePoseTorque(void);
+
 // Assume default pose (Balance - MotionPage 224)
 void moveToDefaultPose(void);
 
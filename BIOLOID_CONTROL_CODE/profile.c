@@ -0,0 +1,122 @@
+/*
+ * profile.c - hot path profiler, keeps min/max/mean and a log2 histogram
+ *	of the run time of named regions, dumped with the PROF command
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include "global.h"
+#include "profile.h"
+
+#ifdef PROFILER
+
+// statistics of one region, times in timestamp counts
+typedef struct
+{
+	uint32 Count;
+	uint32 Min;
+	uint32 Max;
+	uint32 Total;						// for the mean
+	uint16 Buckets[PROFILE_BUCKETS];	// saturate at 0xFFFF
+} profileRegion;
+
+static profileRegion profile_regions[PROFILE_REGIONS];
+
+// region names in the order of the PROFILE_xxx numbers
+const char PROFILENAME0[] PROGMEM = "sensor read";
+const char PROFILENAME1[] PROGMEM = "sensor process";
+const char PROFILENAME2[] PROGMEM = "command parse";
+const char PROFILENAME3[] PROGMEM = "step";
+const char PROFILENAME4[] PROGMEM = "page unpack";
+const char PROFILENAME5[] PROGMEM = "sync write";
+const char PROFILENAME6[] PROGMEM = "wait pose";
+PGM_P PROFILENAME_POINTER[] PROGMEM = {
+PROFILENAME0, PROFILENAME1, PROFILENAME2, PROFILENAME3, PROFILENAME4,
+PROFILENAME5, PROFILENAME6 };
+
+// add one run time (in timestamp counts) to the statistics of a region
+void profile_record(uint8 region, unsigned long time)
+{
+	profileRegion *stats = &profile_regions[region];
+	uint8 bucket = 0;
+
+	if( stats->Count == 0 || time < stats->Min ) {
+		stats->Min = time;
+	}
+	if( time > stats->Max ) {
+		stats->Max = time;
+	}
+	stats->Count++;
+	stats->Total += time;
+
+	// log2 bucket of the time
+	while( (time >>= 1) != 0 && bucket < PROFILE_BUCKETS-1 ) {
+		bucket++;
+	}
+	if( stats->Buckets[bucket] != 0xFFFF ) {
+		stats->Buckets[bucket]++;
+	}
+}
+
+// print a time in timestamp counts as us with one decimal
+static void printTime(uint32 time)
+{
+	time = time * 10 / CLOCK_COUNTS_PER_US;
+	printf_P(PSTR(" %7lu.%lu"), (unsigned long) (time / 10), (unsigned long) (time % 10));
+}
+
+// print the statistics of all regions and start over
+// One line per region with count, min/mean/max in us and the histogram
+// as bucket:count for the non-empty buckets (bucket n = 2^n counts and up).
+void profile_report(void)
+{
+	char name[16];
+	profileRegion *stats;
+	uint8 i, j;
+
+	printf_P(PSTR("\nProfile (us)   count        min       mean        max  log2 histogram\n"));
+	for (i=0; i<PROFILE_REGIONS; i++)
+	{
+		stats = &profile_regions[i];
+		strcpy_P(name, (PGM_P)pgm_read_word(&(PROFILENAME_POINTER[i])));
+		printf_P(PSTR("%-14s %6lu"), name, (unsigned long) stats->Count);
+		if( stats->Count > 0 ) {
+			printTime(stats->Min);
+			printTime(stats->Total / stats->Count);
+			printTime(stats->Max);
+			printf_P(PSTR(" "));
+			for (j=0; j<PROFILE_BUCKETS; j++) {
+				if( stats->Buckets[j] != 0 ) {
+					printf_P(PSTR(" %i:%u"), j, stats->Buckets[j]);
+				}
+			}
+		}
+		printf_P(PSTR("\n"));
+	}
+	printf_P(PSTR("> "));
+	memset(profile_regions, 0, sizeof(profile_regions));
+}
+
+#else
+
+// print the statistics of all regions and start over
+void profile_report(void)
+{
+	printf_P(PSTR("\nProfiler disabled (PROFILER in global.h)\n> "));
+}
+
+#endif
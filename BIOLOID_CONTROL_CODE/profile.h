@@ -0,0 +1,57 @@
+/*
+ * profile.h - hot path profiler, keeps min/max/mean and a log2 histogram
+ *	of the run time of named regions, dumped with the PROF command
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "global.h"
+#include "clock.h"
+
+// the profiled regions
+#define PROFILE_SENSOR_READ		0		// adc_readSensors()
+#define PROFILE_SENSOR_PROCESS	1		// adc_processSensorData()
+#define PROFILE_COMMAND_PARSE	2		// sendCommand() / serialReceiveCommand()
+#define PROFILE_STEP			3		// executeMotionStep()
+#define PROFILE_UNPACK			4		// unpacking a page from Flash
+#define PROFILE_SYNC_WRITE		5		// goal position/speed and balance sync writes
+#define PROFILE_WAIT_POSE		6		// waitForPoseFinish()
+#define PROFILE_REGIONS			7
+
+// Region times are kept in clock_timestamp() counts (0.5us at 16MHz).
+// Histogram bucket n counts times from 2^n to 2^(n+1)-1 counts, the last
+// bucket also everything longer.
+#define PROFILE_BUCKETS			16
+
+// Put PROFILE_START(region) at the start of a region and PROFILE_END(region) at
+// its end, in the same function. Without PROFILER in global.h both expand to nothing.
+#ifdef PROFILER
+  #define PROFILE_START(region)	uint32 profile_start_##region = clock_timestamp()
+  #define PROFILE_END(region)	profile_record(region, clock_timestamp() - profile_start_##region)
+#else
+  #define PROFILE_START(region)
+  #define PROFILE_END(region)
+#endif
+
+// add one run time (in timestamp counts) to the statistics of a region
+void profile_record(uint8 region, unsigned long time);
+
+// print the statistics of all regions and start over
+void profile_report(void);
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,411 @@
+/*
+ * scheduler.c - cooperative task scheduler for the main loop, tasks are
+ *	released periodically or by the control tick and run to completion
+ *	by priority and deadline
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include "global.h"
+#include "scheduler.h"
+#include "clock.h"
+#include "tick.h"
+#include "watchdog.h"
+
+static schedulerTask scheduler_tasks[MAX_SCHEDULER_TASKS];
+static uint8 scheduler_num_tasks = 0;
+static volatile uint8 scheduler_running = SCHEDULER_NO_TASK;	// task of the slice in progress
+static uint8 scheduler_heartbeats = 0;		// tasks with a slice since the last watchdog kick
+
+// The timer wheel, the expiry times of the interval timers. The dispatcher
+// only compares the time with the earliest one, unless that is due.
+static schedulerTimer scheduler_timers[MAX_SCHEDULER_TIMERS];
+static uint8 scheduler_num_timers = 0;
+static unsigned long timer_next_due = 0;	// earliest Due of all timers
+static unsigned long scheduler_time = 0;	// millis() of the current dispatch pass
+
+// CPU load accounting, the load is whatever time the scheduler didn't spend idle
+#define LOAD_WINDOW_COUNTS	((uint32) LOAD_WINDOW * 1000 * CLOCK_COUNTS_PER_US)
+static uint32 load_window_start = 0;		// clock_timestamp() of the window start
+static uint32 load_idle = 0;				// counts spent idle in the current window
+static uint16 load_history[LOAD_HISTORY];	// load of the last windows in 0.1%
+static uint8 load_index = 0;				// next entry of the history
+static uint8 load_windows = 0;				// windows in the history so far
+
+// clear the task table
+void scheduler_init(void)
+{
+	scheduler_num_tasks = 0;
+	scheduler_heartbeats = 0;
+	load_window_start = clock_timestamp();
+	load_idle = 0;
+	load_index = 0;
+	load_windows = 0;
+}
+
+// add a task, the first release is right away (or at the next control tick)
+// Returns	(int)	  -1  - task table full or bad period/deadline
+//					>= 0  - task id
+int scheduler_addTask(void (*run)(void), uint16 period, uint16 deadline, uint8 priority)
+{
+	schedulerTask *task;
+
+	if( scheduler_num_tasks >= MAX_SCHEDULER_TASKS || deadline == 0 ) {
+		return -1;
+	}
+	task = &scheduler_tasks[scheduler_num_tasks];
+	task->Run = run;
+	task->Period = period;
+	task->Deadline = deadline;
+	task->Priority = priority;
+	task->Release = millis();
+	task->Overruns = 0;
+	task->MaxRuntime = 0;
+	task->Tick = tick_getCount();
+	task->MissedTicks = 0;
+	task->MaxStartLatency = 0;
+	task->MaxEndLatency = 0;
+	task->Busy = 0;
+	task->Load = 0;
+	task->MaxLoad = 0;
+
+	return scheduler_num_tasks++;
+}
+
+// Returns	(uint8)	bit mask of all tasks
+static uint8 allTasks(void)
+{
+	return (uint8) ((1 << scheduler_num_tasks) - 1);
+}
+
+// a task finished a slice, the watchdog is only kicked once every task has
+// done so - a task that hangs or is starved leads to a watchdog reset
+static void heartbeat(uint8 task_id)
+{
+	scheduler_heartbeats |= (1 << task_id);
+	if( scheduler_heartbeats == allTasks() ) {
+		watchdog_kick();
+		scheduler_heartbeats = 0;
+	}
+}
+
+// add an interval timer, the first expiry is one interval from now
+// Returns	(int)	  -1  - timer table full or interval 0
+//					>= 0  - timer id
+int scheduler_addTimer(uint16 interval)
+{
+	schedulerTimer *timer;
+
+	if( scheduler_num_timers >= MAX_SCHEDULER_TIMERS || interval == 0 ) {
+		return -1;
+	}
+	timer = &scheduler_timers[scheduler_num_timers];
+	timer->Interval = interval;
+	timer->Due = millis() + interval;
+	timer->Expired = FALSE;
+	if( scheduler_num_timers == 0 || (long) (timer->Due - timer_next_due) < 0 ) {
+		timer_next_due = timer->Due;
+	}
+	return scheduler_num_timers++;
+}
+
+// Returns	(bool)	TRUE once for each expiry of the timer since the last call
+//					(expiries that were not picked up in time are merged)
+bool scheduler_timerExpired(uint8 timer_id)
+{
+	if( timer_id >= scheduler_num_timers || !scheduler_timers[timer_id].Expired ) {
+		return FALSE;
+	}
+	scheduler_timers[timer_id].Expired = FALSE;
+	return TRUE;
+}
+
+// flag the timers that are due and find the next expiry
+static void expireTimers(unsigned long now)
+{
+	schedulerTimer *timer;
+	unsigned long next = now + 0xFFFF;		// no interval is longer
+	uint8 i;
+
+	for (i=0; i<scheduler_num_timers; i++)
+	{
+		timer = &scheduler_timers[i];
+		if( (long) (now - timer->Due) >= 0 ) {
+			timer->Expired = TRUE;
+			// keep the interval fixed, unless we fell a whole interval behind
+			timer->Due += timer->Interval;
+			if( (long) (now - timer->Due) >= 0 ) {
+				timer->Due = now + timer->Interval;
+			}
+		}
+		if( (long) (timer->Due - next) < 0 ) {
+			next = timer->Due;
+		}
+	}
+	timer_next_due = next;
+}
+
+// Returns	(uint16)	share of the window in 0.1% (at most 100%)
+static uint16 loadShare(uint32 counts, uint32 elapsed)
+{
+	uint32 share = counts / (elapsed / 1000);
+
+	return (share > 1000) ? 1000 : share;
+}
+
+// close the load window once it is over and start the next one
+static void closeLoadWindow(uint32 now)
+{
+	schedulerTask *task;
+	uint32 elapsed = now - load_window_start;
+	uint8 i;
+
+	if( elapsed < LOAD_WINDOW_COUNTS ) {
+		return;
+	}
+	load_history[load_index] = 1000 - loadShare(load_idle, elapsed);
+	load_index = (load_index + 1) % LOAD_HISTORY;
+	if( load_windows < LOAD_HISTORY ) {
+		load_windows++;
+	}
+	for (i=0; i<scheduler_num_tasks; i++)
+	{
+		task = &scheduler_tasks[i];
+		task->Load = loadShare(task->Busy, elapsed);
+		if( task->Load > task->MaxLoad ) {
+			task->MaxLoad = task->Load;
+		}
+		task->Busy = 0;
+	}
+	load_window_start = now;
+	load_idle = 0;
+}
+
+// book the end of a slice of a task released by the control tick
+static void tickTaskDone(schedulerTask *task)
+{
+	uint16 tick, since;
+	uint32 latency;
+
+	tick_read(&tick, &since);
+	latency = (uint32) (uint16) (tick - task->Tick) * TICK_PERIOD_US + since;
+	if( latency > task->MaxEndLatency ) {
+		task->MaxEndLatency = (latency > 0xFFFF) ? 0xFFFF : latency;
+	}
+	if( latency > (uint32) task->Deadline * 1000 ) {
+		task->Overruns++;
+	}
+}
+
+// book the end of a slice of a periodic task and set its next release
+// (now is the end of the slice, the pass snapshot plus the runtime)
+static void periodicTaskDone(schedulerTask *task, unsigned long now)
+{
+	// late slices count as overruns, a release missed completely as well
+	if( now - task->Release > task->Deadline ) {
+		task->Overruns++;
+	}
+	// the next release keeps the period fixed, unless we fell a whole period behind
+	task->Release += task->Period;
+	if( (long) (now - task->Release) >= 0 ) {
+		task->Release = now;
+	}
+}
+
+// run the most urgent released task (if any) to completion
+// Tasks are picked by priority first and then by the earliest deadline, so a
+// slow low priority slice can delay an urgent task by at most its own runtime.
+// Returns	(bool)	TRUE if a task was run
+bool scheduler_dispatch(void)
+{
+	schedulerTask *task, *next = NULL;
+	unsigned long now;
+	uint32 start, runtime;
+	uint16 tick, since;
+	uint8 i;
+
+	start = clock_timestamp();
+	closeLoadWindow(start);
+	// one time snapshot for the whole pass, a single compare unless a timer is due
+	now = millis();
+	scheduler_time = now;
+	if( (long) (now - timer_next_due) >= 0 ) {
+		expireTimers(now);
+	}
+	tick_read(&tick, &since);
+	for (i=0; i<scheduler_num_tasks; i++)
+	{
+		task = &scheduler_tasks[i];
+		if( task->Period == SCHEDULER_TICK ) {
+			// released by every tick since its last slice
+			if( task->Tick == tick ) {
+				continue;
+			}
+			task->Release = now - since / 1000;
+		} else if( (long) (now - task->Release) < 0 ) {
+			// not released yet (the difference wraps around when Release is in the future)
+			continue;
+		}
+		if( next == NULL || task->Priority < next->Priority ||
+			(task->Priority == next->Priority &&
+			 (long) ((task->Release + task->Deadline) - (next->Release + next->Deadline)) < 0) ) {
+			next = task;
+		}
+	}
+	if( next == NULL ) {
+		// idle path, the time of the empty pass is headroom
+		load_idle += clock_timestamp() - start;
+		return FALSE;
+	}
+
+	if( next->Period == SCHEDULER_TICK ) {
+		// the slice serves the latest tick, older ones were missed
+		next->MissedTicks += (uint16) (tick - next->Tick) - 1;
+		next->Tick = tick;
+		if( since > next->MaxStartLatency ) {
+			next->MaxStartLatency = since;
+		}
+	}
+
+	scheduler_running = next - scheduler_tasks;
+	start = clock_timestamp();
+	next->Run();
+	runtime = clock_timestamp() - start;
+	scheduler_running = SCHEDULER_NO_TASK;
+	heartbeat(next - scheduler_tasks);
+	next->Busy += runtime;
+	runtime /= CLOCK_COUNTS_PER_US;
+	if( runtime > next->MaxRuntime ) {
+		next->MaxRuntime = (runtime > 0xFFFF) ? 0xFFFF : runtime;
+	}
+
+	if( next->Period == SCHEDULER_TICK ) {
+		tickTaskDone(next);
+	} else {
+		periodicTaskDone(next, scheduler_time + runtime / 1000);
+	}
+	return TRUE;
+}
+
+// Returns	(uint16)	number of deadline overruns of a task
+uint16 scheduler_getOverruns(uint8 task_id)
+{
+	if( task_id >= scheduler_num_tasks ) {
+		return 0;
+	}
+	return scheduler_tasks[task_id].Overruns;
+}
+
+// Returns	(uint8)	id of the task whose slice is running, SCHEDULER_NO_TASK if none
+uint8 scheduler_getRunning(void)
+{
+	return scheduler_running;
+}
+
+// Returns	(uint8)	bit mask of the tasks that haven't finished a slice since the
+//					watchdog was kicked last
+uint8 scheduler_getMissingHeartbeats(void)
+{
+	return allTasks() & ~scheduler_heartbeats;
+}
+
+// Returns	(unsigned long)	millis() at the start of the current dispatch pass,
+//							the task of the pass and the timers all see this time
+unsigned long scheduler_now(void)
+{
+	return scheduler_time;
+}
+
+// take the time snapshot again, for a task that starts timing something
+// after a long bus transfer (the rest of the pass sees the new time)
+// Returns	(unsigned long)	the new scheduler_now()
+unsigned long scheduler_refresh(void)
+{
+	scheduler_time = millis();
+	return scheduler_time;
+}
+
+// Returns	(uint16)	CPU load of the last load window in 0.1% (everything
+//						but the idle time of the scheduler, so interrupts count too)
+uint16 scheduler_getLoad(void)
+{
+	if( load_windows == 0 ) {
+		return 0;
+	}
+	return load_history[(load_index + LOAD_HISTORY - 1) % LOAD_HISTORY];
+}
+
+// print the timing statistics of all tasks
+void scheduler_report(void)
+{
+	schedulerTask *task;
+	uint8 i;
+
+	printf_P(PSTR("\nTask  period  overruns  max run us"));
+	printf_P(PSTR("  (tick tasks: missed ticks, max start/end latency us)\n"));
+	for (i=0; i<scheduler_num_tasks; i++)
+	{
+		task = &scheduler_tasks[i];
+		if( task->Period == SCHEDULER_TICK ) {
+			printf_P(PSTR("%4i    tick"), i);
+		} else {
+			printf_P(PSTR("%4i  %4ims"), i, task->Period);
+		}
+		printf_P(PSTR("  %8u  %10u"), task->Overruns, task->MaxRuntime);
+		if( task->Period == SCHEDULER_TICK ) {
+			printf_P(PSTR("  %u, %u/%u"), task->MissedTicks, task->MaxStartLatency, task->MaxEndLatency);
+		}
+		printf_P(PSTR("\n"));
+	}
+	printf_P(PSTR("> "));
+}
+
+// print a load in 0.1% as a percentage
+static void printLoad(uint16 load)
+{
+	printf_P(PSTR("%3u.%u%%"), load / 10, load % 10);
+}
+
+// print the CPU load of the tasks and the worst window of the load history
+void scheduler_loadReport(void)
+{
+	schedulerTask *task;
+	uint16 worst = 0;
+	uint8 i;
+
+	for (i=0; i<load_windows; i++)
+	{
+		if( load_history[i] > worst ) {
+			worst = load_history[i];
+		}
+	}
+	printf_P(PSTR("\nTask    load     max  (windows of %ims)\n"), LOAD_WINDOW);
+	for (i=0; i<scheduler_num_tasks; i++)
+	{
+		task = &scheduler_tasks[i];
+		printf_P(PSTR("%4i  "), i);
+		printLoad(task->Load);
+		printf_P(PSTR("  "));
+		printLoad(task->MaxLoad);
+		printf_P(PSTR("\n"));
+	}
+	printf_P(PSTR("CPU   "));
+	printLoad(scheduler_getLoad());
+	printf_P(PSTR(", worst "));
+	printLoad(worst);
+	printf_P(PSTR(" in the last %i windows\n> "), load_windows);
+}
@@ -0,0 +1,110 @@
+/*
+ * scheduler.h - cooperative task scheduler for the main loop, tasks are
+ *	released periodically or by the control tick and run to completion
+ *	by priority and deadline
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "global.h"
+
+// period of tasks released by the control tick (see tick.c)
+#define SCHEDULER_TICK		0
+// scheduler_getRunning() outside of a slice
+#define SCHEDULER_NO_TASK	0xFF
+
+// one periodic task
+typedef struct
+{
+	void (*Run)(void);			// the slice, must return (no waiting inside)
+	uint16 Period;				// ms between releases or SCHEDULER_TICK
+	uint16 Deadline;			// ms after the release by which the slice has to be done
+	uint8  Priority;			// 0 is the most urgent
+	unsigned long Release;		// millis() of the current release
+	uint16 Overruns;			// slices that finished after their deadline
+	uint16 MaxRuntime;			// longest slice in us
+	// tasks released by the control tick only
+	uint16 Tick;				// tick count of the last slice
+	uint16 MissedTicks;			// ticks that passed without a slice
+	uint16 MaxStartLatency;		// longest time from the tick release to the start in us
+	uint16 MaxEndLatency;		// longest time from the tick release to the end in us
+	// CPU load
+	uint32 Busy;				// clock_timestamp() counts run in the current load window
+	uint16 Load;				// share of the last load window in 0.1%
+	uint16 MaxLoad;				// largest share of any window in 0.1%
+} schedulerTask;
+
+// one interval timer of the timer wheel
+typedef struct
+{
+	unsigned long Due;			// millis() of the next expiry
+	uint16 Interval;			// ms between expiries
+	bool   Expired;				// set on expiry, cleared by scheduler_timerExpired()
+} schedulerTimer;
+
+// clear the task table (the timers stay)
+void scheduler_init(void);
+
+// add a task, the first release is right away (or at the next control tick)
+// Returns	(int)	  -1  - task table full or bad period/deadline
+//					>= 0  - task id
+int scheduler_addTask(void (*run)(void), uint16 period, uint16 deadline, uint8 priority);
+
+// run the most urgent released task (if any) to completion
+// Returns	(bool)	TRUE if a task was run
+bool scheduler_dispatch(void);
+
+// Returns	(uint16)	number of deadline overruns of a task
+uint16 scheduler_getOverruns(uint8 task_id);
+
+// Returns	(uint8)	id of the task whose slice is running, SCHEDULER_NO_TASK if none
+uint8 scheduler_getRunning(void);
+
+// Returns	(uint8)	bit mask of the tasks that haven't finished a slice since the
+//					watchdog was kicked last
+uint8 scheduler_getMissingHeartbeats(void);
+
+// Returns	(unsigned long)	millis() at the start of the current dispatch pass,
+//							the task of the pass and the timers all see this time
+unsigned long scheduler_now(void);
+
+// take the time snapshot again, for a task that starts timing something
+// after a long bus transfer (the rest of the pass sees the new time)
+// Returns	(unsigned long)	the new scheduler_now()
+unsigned long scheduler_refresh(void);
+
+// add an interval timer, the first expiry is one interval from now
+// Returns	(int)	  -1  - timer table full or interval 0
+//					>= 0  - timer id
+int scheduler_addTimer(uint16 interval);
+
+// Returns	(bool)	TRUE once for each expiry of the timer since the last call
+//					(expiries that were not picked up in time are merged)
+bool scheduler_timerExpired(uint8 timer_id);
+
+// Returns	(uint16)	CPU load of the last load window in 0.1% (everything
+//						but the idle time of the scheduler, so interrupts count too)
+uint16 scheduler_getLoad(void);
+
+// print the timing statistics of all tasks
+void scheduler_report(void);
+
+// print the CPU load of the tasks and the worst window of the load history
+void scheduler_loadReport(void);
+
+#endif /* SCHEDULER_H_ */
@@ -9,6 +9,10 @@
 #include <util/delay.h>
 #include "global.h"
 #include "serial.h"
+#include "motion_sequence.h"
+#include "profile.h"
+#include "mailbox.h"
+#include "clock.h"
 
 
 // Command Strings List - kept in Flash to conserve RAM
@@ -37,18 +41,34 @@ const char COMMANDSTR21[] PROGMEM = "M   ";
 const char COMMANDSTR22[] PROGMEM = "FGUP";
 const char COMMANDSTR23[] PROGMEM = "BGUP";
 const char COMMANDSTR24[] PROGMEM = "RSET";
+const char COMMANDSTR25[] PROGMEM = "LOAD";
+const char COMMANDSTR26[] PROGMEM = "C   ";
+const char COMMANDSTR27[] PROGMEM = "CACH";
+const char COMMANDSTR28[] PROGMEM = "PROF";
+const char COMMANDSTR29[] PROGMEM = "TASK";
+const char COMMANDSTR30[] PROGMEM = "MBOX";
+const char COMMANDSTR31[] PROGMEM = "LATY";
+const char COMMANDSTR32[] PROGMEM = "CPU ";
+const char COMMANDSTR33[] PROGMEM = "FAST";
+const char COMMANDSTR34[] PROGMEM = "LIMT";
 PGM_P COMMANDSTR_POINTER[] PROGMEM = { 
 COMMANDSTR0, COMMANDSTR1, COMMANDSTR2, COMMANDSTR3, COMMANDSTR4,
 COMMANDSTR5, COMMANDSTR6, COMMANDSTR7, COMMANDSTR8, COMMANDSTR9,
 COMMANDSTR10, COMMANDSTR11, COMMANDSTR12, COMMANDSTR13, COMMANDSTR14, 
 COMMANDSTR15, COMMANDSTR16, COMMANDSTR17, COMMANDSTR18, COMMANDSTR19,
-COMMANDSTR20, COMMANDSTR21, COMMANDSTR22, COMMANDSTR23, COMMANDSTR24 };
+COMMANDSTR20, COMMANDSTR21, COMMANDSTR22, COMMANDSTR23, COMMANDSTR24,
+COMMANDSTR25, COMMANDSTR26, COMMANDSTR27, COMMANDSTR28, COMMANDSTR29,
+COMMANDSTR30, COMMANDSTR31, COMMANDSTR32, COMMANDSTR33, COMMANDSTR34 };
 
 // set up the read buffer
 volatile unsigned char gbSerialBuffer[MAXNUM_SERIALBUFF] = {0};
 volatile unsigned char gbSerialBufferHead = 0;
 volatile unsigned char gbSerialBufferTail = 0;
 static FILE *device;
+// raw mode passes all bytes straight to the buffer (binary uploads)
+static volatile uint8 serial_raw_mode = 0;
+// clock_timestamp() of the end of the last command line
+static volatile uint32 serial_command_time = 0;
 
 // global variables
 extern volatile uint8 bioloid_command;			// current command
@@ -56,6 +76,7 @@ extern volatile uint8 last_bioloid_command;		// last command
 extern volatile uint8 flag_receive_ready;		// received complete command flag
 extern volatile uint8 current_motion_page;		// current motion page
 extern volatile uint8 next_motion_page;			// next motion page if we got new command
+extern volatile uint8 next_motion_sequence;		// combo sequence of the C# command
 
 // internal function prototypes
 void serial_put_queue( unsigned char data );
@@ -77,10 +98,16 @@ SIGNAL(USART1_RX_vect)
 	char c;
 	
 	c = UDR1;
+	// in raw mode there are no commands and no echo
+	if (serial_raw_mode)
+	{
+		serial_put_queue( c );
+	}
 	// check if we have received a CR+LF indicating complete string
-	if (c == '\r')
+	else if (c == '\r')
 	{
 		// command complete, set flag and write termination byte to buffer
+		serial_command_time = clock_timestamp();
 		flag_receive_ready = 1;
 		serial_put_queue( 0xFF );
 		c = '\n';
@@ -169,6 +196,8 @@ int sendCommand(char *command)
 {
 	char c1, c2, c3, c4, buffer[6];
 	int match;
+	uint8 cmd = COMMAND_NOT_FOUND, page = 0;
+	PROFILE_START(PROFILE_COMMAND_PARSE);
     printf("Entro al sistema\n");
 	// loop over all known commands to find a match
 	for (uint8 i=0; i<NUMBER_OF_COMMANDS; i++)
@@ -180,75 +209,73 @@ int sendCommand(char *command)
 		{		
 			printf("Encontro coicidencia \n %s",command);	
 			// we found a match set the command
-			last_bioloid_command = bioloid_command;
-			bioloid_command = i;
+			cmd = i;
 			break;
 		} 
 		
 		// if we get to end of loop we haven't found a match
 		if ( i== NUMBER_OF_COMMANDS-1 )
 		{
-			last_bioloid_command = bioloid_command;
 			// 0xFF means no match found
-			bioloid_command = COMMAND_NOT_FOUND;
+			cmd = COMMAND_NOT_FOUND;
 		}
 	}
 	
 		// cross-check against the definitions in global.h 
 	   
-		switch ( bioloid_command )
+		switch ( cmd )
 		{
 			case COMMAND_WALK_READY:
-				next_motion_page = COMMAND_WALK_READY_MP;
+				page = COMMAND_WALK_READY_MP;
 				break;
 			case COMMAND_SIT:
-				next_motion_page = COMMAND_SIT_MP;
+				page = COMMAND_SIT_MP;
 				break;
 			case COMMAND_STAND:
-				next_motion_page = COMMAND_STAND_MP;
+				page = COMMAND_STAND_MP;
 				break;
 			case COMMAND_BALANCE:
-				next_motion_page = COMMAND_BALANCE_MP;
+				page = COMMAND_BALANCE_MP;
 				break;
 			case COMMAND_BACK_GET_UP:
-				next_motion_page = COMMAND_BACK_GET_UP_MP;
+				page = COMMAND_BACK_GET_UP_MP;
 				break;
 			case COMMAND_FRONT_GET_UP:
-				next_motion_page = COMMAND_FRONT_GET_UP_MP;
+				page = COMMAND_FRONT_GET_UP_MP;
 				break;
 			case COMMAND_RESET:
-				next_motion_page = COMMAND_RESET_MP;
+				page = COMMAND_RESET_MP;
 				break;
 		}
 	
 	// otherwise it's easier to calculate the motion page for walk commands
-	if( bioloid_command >= COMMAND_WALK_FORWARD  )
+	if( cmd >= COMMAND_WALK_FORWARD  )
 	{
 		// all walk command motion pages are in sequence and 12 pages apart each
-		printf("Valor comando %i\n",bioloid_command);
-		next_motion_page = 12*(bioloid_command-1) + COMMAND_WALK_READY_MP + 1;
-		printf("Valor pagina next motion %i\n",next_motion_page);
+		printf("Valor comando %i\n",cmd);
+		page = 12*(cmd-1) + COMMAND_WALK_READY_MP + 1;
+		printf("Valor pagina next motion %i\n",page);
 	}
 	
 	// before we leave we need to check for special case of Motion Page command
-	if( bioloid_command == COMMAND_NOT_FOUND ) 
+	if( cmd == COMMAND_NOT_FOUND ) 
 	{
 		if ( c1 == 'M' && (c2 >= '0' && c2 <= '9') )
 		{
 			// we definitely have a motion page, find the number
-			bioloid_command = COMMAND_MOTIONPAGE;
-			next_motion_page = c2 - 48;	// converts ASCII to number
+			cmd = COMMAND_MOTIONPAGE;
+			page = c2 - 48;	// converts ASCII to number
 			// check if next character is still a number
 			if ( c3 >= '0' && c3 <= '9' )
 			{
-				next_motion_page = next_motion_page * 10;
-				next_motion_page += (c3-48); 
+				page = page * 10;
+				page += (c3-48); 
 			}
 			// check if next character is still a number
 			if ( c4 >= '0' && c4 <= '9' )
 			{
-				next_motion_page = next_motion_page * 10;
-				next_motion_page += (c4-48); 
+				page = page * 10;
+				page += (c4-48); 
 			}
 		}
 	}
@@ -257,16 +284,21 @@ int sendCommand(char *command)
 	flag_receive_ready = 0;
 	
 	// finally echo the command and write new command prompt
-	if ( bioloid_command == COMMAND_MOTIONPAGE ) {
-		printf( "%c%c%c%c - MotionPageCommand %i\n> ", c1, c2, c3, c4, next_motion_page );
-	} else if( bioloid_command != COMMAND_NOT_FOUND ) {
-		printf( "%c%c%c%c - Command # %i\n> ", c1, c2, c3, c4, bioloid_command );
+	if ( cmd == COMMAND_MOTIONPAGE ) {
+		printf( "%c%c%c%c - MotionPageCommand %i\n> ", c1, c2, c3, c4, page );
+	} else if( cmd != COMMAND_NOT_FOUND ) {
+		printf( "%c%c%c%c - Command # %i\n> ", c1, c2, c3, c4, cmd );
 	} else {
 		printf( "%c%c%c%c \nUnknown Command! \n> ", c1, c2, c3, c4 );
 	}	
 	
+	// hand the command to the motion executor
+	if ( cmd != COMMAND_NOT_FOUND ) {
+		mailbox_post(MAILBOX_OPERATOR, cmd, page, 0);
+	}
+	PROFILE_END(PROFILE_COMMAND_PARSE);
 	// set command received flag only if valid command
-	if ( bioloid_command == COMMAND_NOT_FOUND ) {
+	if ( cmd == COMMAND_NOT_FOUND ) {
 		return 0;
 	} else {
 		return 1;
@@ -276,12 +308,14 @@ int serialReceiveCommand()
 {
 	char c1, c2, c3, c4, command[6], buffer[6];
 	int match;
+	uint8 cmd = COMMAND_NOT_FOUND, page = 0, sequence = 0;
 	
 	if (flag_receive_ready == 0)
 	{
 		// nothing to do, go straight back to main loop
 		return 0;
 	}
+	PROFILE_START(PROFILE_COMMAND_PARSE);
 	
 	// we have a new command, get characters 
 	c1 = serial_get_queue();
@@ -317,78 +351,90 @@ int serialReceiveCommand()
 		if ( match == 0 )
 		{			
 			// we found a match set the command
-			last_bioloid_command = bioloid_command;
-			bioloid_command = i;
+			cmd = i;
 			break;
 		} 
 		
 		// if we get to end of loop we haven't found a match
 		if ( i== NUMBER_OF_COMMANDS-1 )
 		{
-			last_bioloid_command = bioloid_command;
 			// 0xFF means no match found
-			bioloid_command = COMMAND_NOT_FOUND;
+			cmd = COMMAND_NOT_FOUND;
 		}
 	}
 	
 	// find the motion page associated with the command for non-walk commands
-	if ( bioloid_command != COMMAND_NOT_FOUND && bioloid_command >= COMMAND_WALK_READY )
+	if ( cmd != COMMAND_NOT_FOUND && cmd >= COMMAND_WALK_READY )
 	{
 		// cross-check against the definitions in global.h 
 	   
-		switch ( bioloid_command )
+		switch ( cmd )
 		{
 			case COMMAND_WALK_READY:
-				next_motion_page = COMMAND_WALK_READY_MP;
+				page = COMMAND_WALK_READY_MP;
 				break;
 			case COMMAND_SIT:
-				next_motion_page = COMMAND_SIT_MP;
+				page = COMMAND_SIT_MP;
 				break;
 			case COMMAND_STAND:
-				next_motion_page = COMMAND_STAND_MP;
+				page = COMMAND_STAND_MP;
 				break;
 			case COMMAND_BALANCE:
-				next_motion_page = COMMAND_BALANCE_MP;
+				page = COMMAND_BALANCE_MP;
 				break;
 			case COMMAND_BACK_GET_UP:
-				next_motion_page = COMMAND_BACK_GET_UP_MP;
+				page = COMMAND_BACK_GET_UP_MP;
 				break;
 			case COMMAND_FRONT_GET_UP:
-				next_motion_page = COMMAND_FRONT_GET_UP_MP;
+				page = COMMAND_FRONT_GET_UP_MP;
 				break;
 			case COMMAND_RESET:
-				next_motion_page = COMMAND_RESET_MP;
+				page = COMMAND_RESET_MP;
 				break;
 		}
 	} 
 	// otherwise it's easier to calculate the motion page for walk commands
-	else if( bioloid_command >= COMMAND_WALK_FORWARD && bioloid_command < COMMAND_WALK_READY )
+	else if( cmd >= COMMAND_WALK_FORWARD && cmd < COMMAND_WALK_READY )
 	{
 		// all walk command motion pages are in sequence and 12 pages apart each
-		printf("Valor comando %i\n",bioloid_command);
-		next_motion_page = 12*(bioloid_command-1) + COMMAND_WALK_READY_MP + 1;
-		printf("Valor pagina next motion %i\n",next_motion_page);
+		printf_P(PSTR("Valor comando %i\n"),cmd);
+		page = 12*(cmd-1) + COMMAND_WALK_READY_MP + 1;
+		printf_P(PSTR("Valor pagina next motion %i\n"),page);
 	}
 	
 	// before we leave we need to check for special case of Motion Page command
-	if( bioloid_command == COMMAND_NOT_FOUND ) 
+	if( cmd == COMMAND_NOT_FOUND ) 
 	{
 		if ( c1 == 'M' && (c2 >= '0' && c2 <= '9') )
 		{
 			// we definitely have a motion page, find the number
-			bioloid_command = COMMAND_MOTIONPAGE;
-			next_motion_page = c2 - 48;	// converts ASCII to number
+			cmd = COMMAND_MOTIONPAGE;
+			page = c2 - 48;	// converts ASCII to number
 			// check if next character is still a number
 			if ( c3 >= '0' && c3 <= '9' )
 			{
-				next_motion_page = next_motion_page * 10;
-				next_motion_page += (c3-48); 
+				page = page * 10;
+				page += (c3-48); 
 			}
 			// check if next character is still a number
 			if ( c4 >= '0' && c4 <= '9' )
 			{
-				next_motion_page = next_motion_page * 10;
-				next_motion_page += (c4-48); 
+				page = page * 10;
+				page += (c4-48); 
+			}
+		}
+		// or a combo sequence, checked now so a bad one never starts moving
+		else if ( c1 == 'C' && (c2 >= '0' && c2 <= '9') )
+		{
+			sequence = c2 - 48;	// converts ASCII to number
+			if ( c3 >= '0' && c3 <= '9' )
+			{
+				sequence = sequence * 10;
+				sequence += (c3-48); 
+			}
+			if ( c4 == ' ' && motionSequenceCheck(sequence) == 0 )
+			{
+				cmd = COMMAND_SEQUENCE;
 			}
 		}
 	}
@@ -397,16 +443,23 @@ int serialReceiveCommand()
 	flag_receive_ready = 0;
 	
 	// finally echo the command and write new command prompt
-	if ( bioloid_command == COMMAND_MOTIONPAGE ) {
-		printf( "%c%c%c%c - MotionPageCommand %i\n> ", c1, c2, c3, c4, next_motion_page );
-	} else if( bioloid_command != COMMAND_NOT_FOUND ) {
-		printf( "%c%c%c%c - Command # %i\n> ", c1, c2, c3, c4, bioloid_command );
+	if ( cmd == COMMAND_MOTIONPAGE ) {
+		printf_P(PSTR("%c%c%c%c - MotionPageCommand %i\n> "), c1, c2, c3, c4, page );
+	} else if ( cmd == COMMAND_SEQUENCE ) {
+		printf_P(PSTR("%c%c%c%c - Sequence %i\n> "), c1, c2, c3, c4, sequence );
+	} else if( cmd != COMMAND_NOT_FOUND ) {
+		printf_P(PSTR("%c%c%c%c - Command # %i\n> "), c1, c2, c3, c4, cmd );
 	} else {
-		printf( "%c%c%c%c \nUnknown Command! \n> ", c1, c2, c3, c4 );
+		printf_P(PSTR("%c%c%c%c \nUnknown Command! \n> "), c1, c2, c3, c4 );
 	}	
 	
+	// hand the command to the motion executor
+	if ( cmd != COMMAND_NOT_FOUND ) {
+		mailbox_postReceived(MAILBOX_OPERATOR, cmd, page, sequence, serial_command_time);
+	}
+	PROFILE_END(PROFILE_COMMAND_PARSE);
 	// set command received flag only if valid command
-	if ( bioloid_command == COMMAND_NOT_FOUND ) {
+	if ( cmd == COMMAND_NOT_FOUND ) {
 		return 0;
 	} else {
 		return 1;
@@ -414,6 +467,17 @@ int serialReceiveCommand()
 }
 
 
+// switch raw mode on or off, the receive buffer is flushed either way
+void serial_set_raw_mode(bool raw)
+{
+	cli();
+	serial_raw_mode = raw;
+	gbSerialBufferHead = 0;
+	gbSerialBufferTail = 0;
+	flag_receive_ready = 0;
+	sei();
+}
+
 // write out a data string to the serial port
 void serial_write( unsigned char *pData, int numbyte )
 {
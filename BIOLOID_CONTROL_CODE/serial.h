@@ -60,6 +60,10 @@ unsigned char serial_read( unsigned char *pData, int numbyte );
 // get the status of the input/output queue
 int serial_get_qstate(void);
 
+// Raw mode for binary uploads: no echo, no command parsing, every byte
+// received goes to the buffer. The buffer is flushed when switching.
+void serial_set_raw_mode(bool raw);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,88 @@
+/*
+ * tick.c - fixed rate control tick from TIMER3, releases the balance task
+ *	of the scheduler at CONTROL_TICK_RATE
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "global.h"
+#include "tick.h"
+
+// Interrupt enable/disable macros
+#define ENABLE_TIMER3_INTERRUPT()	TIMSK3 = (1<<OCIE3A)
+#define DISABLE_TIMER3_INTERRUPT()	TIMSK3 = 0
+
+volatile uint16 tick_count = 0;
+
+// TIMER3 compare match A is triggered once every control tick
+ISR (TIMER3_COMPA_vect)
+{
+	tick_count++;
+}
+
+// start the control tick (TIMER3 in CTC mode)
+void tick_init(void)
+{
+	DISABLE_TIMER3_INTERRUPT();
+	TCCR3A = 0;
+	// CTC mode with TOP = OCR3A, prescale factor 256 = 62.5kHz
+	TCCR3B = (1<<WGM32) | (1<<CS32);
+	OCR3A = (F_CPU / TICK_TIMER_PRESCALE / CONTROL_TICK_RATE) - 1;
+	TCNT3 = 0;
+	tick_count = 0;
+	// clear a pending compare match and enable the interrupt
+	bit_set_hi(TIFR3, OCF3A);
+	ENABLE_TIMER3_INTERRUPT();
+}
+
+// Returns	(uint16)	number of control ticks since tick_init (wraps around)
+uint16 tick_getCount(void)
+{
+	uint16 count;
+
+	// disable interrupt while we read the 16 bit count
+	DISABLE_TIMER3_INTERRUPT();
+	count = tick_count;
+	ENABLE_TIMER3_INTERRUPT();
+
+	return count;
+}
+
+// read the tick count and the time since that tick was released
+// Outputs:	(uint16)  tick count
+//			(uint16)  us since the release of that tick (below TICK_PERIOD_US)
+void tick_read(uint16 *count, uint16 *since)
+{
+	uint16 c, t;
+
+	// all interrupts off, not just TIMER3: the 16 bit TCNT3 read goes through
+	// the TEMP register all 16 bit timers share, and the buzzer ISR reads TCNT1
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		c = tick_count;
+		t = TCNT3;
+		// a compare match while interrupts were off, TCNT3 has started over
+		// (read again so the count is after the match for sure)
+		if( TIFR3 & _BV(OCF3A) ) {
+			c++;
+			t = TCNT3;
+		}
+	}
+
+	*count = c;
+	*since = t * TICK_TIMER_US;
+}
@@ -0,0 +1,41 @@
+/*
+ * tick.h - fixed rate control tick from TIMER3, releases the balance task
+ *	of the scheduler at CONTROL_TICK_RATE
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef TICK_H_
+#define TICK_H_
+
+#include "global.h"
+
+// TIMER3 runs at F_CPU/256 = 62.5kHz, so one timer count is 16us
+#define TICK_TIMER_PRESCALE		256
+#define TICK_TIMER_US			(TICK_TIMER_PRESCALE / (F_CPU / 1000000L))
+#define TICK_PERIOD_US			(1000000L / CONTROL_TICK_RATE)
+
+// start the control tick (TIMER3 in CTC mode)
+void tick_init(void);
+
+// Returns	(uint16)	number of control ticks since tick_init (wraps around)
+uint16 tick_getCount(void);
+
+// read the tick count and the time since that tick was released
+// Outputs:	(uint16)  tick count
+//			(uint16)  us since the release of that tick (below TICK_PERIOD_US)
+void tick_read(uint16 *count, uint16 *since);
+
+#endif /* TICK_H_ */
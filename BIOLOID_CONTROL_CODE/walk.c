@@ -23,6 +23,7 @@
 #include "motion_f.h"
 #include "dynamixel.h"
 #include "walk.h"
+#include "mailbox.h"
 
 // Global variables related to the finite state machine that governs execution
 extern volatile uint8 bioloid_command;			// current command
@@ -41,7 +42,8 @@ extern uint8 current_motion_page;
 static uint8 walk_command = 0;
 static uint8 walk_state = 0;
 
-// initialize for walking - assume walk ready pose
+// initialize for walking - call once the walk ready pose is reached
+// (the motion executor plays the walk ready page before the first walk page)
 void walk_init()
 {
 	int commStatus = 0;
@@ -50,10 +52,6 @@ void walk_init()
 	walk_state = 0;
 	walk_command = 0;
 	
-	// and get ready for walking!
-	current_motion_page = COMMAND_WALK_READY_MP;
-	executeMotion(current_motion_page);
-	
 	// experimental - increase punch for walking
 	commStatus = dxl_write_word(BROADCAST_ID, DXL_PUNCH_L, 100);
 	if(commStatus != COMM_RXSUCCESS) {
@@ -220,8 +218,7 @@ int walk_avoidObstacle(int obstacle_flag)
 		if ( adc_dms_distance > SAFE_DISTANCE && adc_ultrasonic_distance > SAFE_DISTANCE )
 		{
 			// have cleared the obstacle, return to walking forward
-			last_bioloid_command = bioloid_command;
-			bioloid_command = COMMAND_WALK_FORWARD;
+			mailbox_post(MAILBOX_AUTONOMY, COMMAND_WALK_FORWARD, WALK_COMMAND_MP(COMMAND_WALK_FORWARD), 0);
 			return -1;
 		} else {
 			// still avoiding, return
@@ -235,8 +232,7 @@ int walk_avoidObstacle(int obstacle_flag)
 		if ( adc_dms_distance < MINIMUM_DISTANCE || adc_ultrasonic_distance < MINIMUM_DISTANCE )
 		{
 			// have found an obstacle, start turning left
-			last_bioloid_command = bioloid_command;
-			bioloid_command = COMMAND_WALK_TURN_LEFT;
+			mailbox_post(MAILBOX_AUTONOMY, COMMAND_WALK_TURN_LEFT, WALK_COMMAND_MP(COMMAND_WALK_TURN_LEFT), 0);
 			return 1;
 		} else {
 			// no obstacle, return
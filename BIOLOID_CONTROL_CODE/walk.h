@@ -22,7 +22,8 @@
 #ifndef WALK_H_
 #define WALK_H_
 
-// initialize for walking - assume walk ready pose
+// initialize for walking - call once the walk ready pose is reached
+// (the motion executor plays the walk ready page before the first walk page)
 void walk_init();
 
 // function to update the walk state
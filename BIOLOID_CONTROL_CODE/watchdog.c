@@ -0,0 +1,136 @@
+/*
+ * watchdog.c - hardware watchdog fed by the scheduler heartbeats, keeps
+ *	a crash record over the reset and reports it at the next boot
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/wdt.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include "global.h"
+#include "watchdog.h"
+#include "scheduler.h"
+#include "clock.h"
+
+// Global variables related to the finite state machine that governs execution
+extern volatile uint8 bioloid_command;			// current command
+extern volatile uint8 last_bioloid_command;		// last command
+extern volatile uint8 current_motion_page;		// current motion page
+extern volatile uint8 current_step;				// number of the current motion page step
+// Dynamixel bus state (dynamixel.c)
+extern int giBusUsing;
+
+// Both survive the reset: .noinit is neither cleared nor copied by the startup
+// code, and the reset flags are read before that code runs.
+watchdogCrashRecord crash_record __attribute__((section(".noinit")));
+uint8 reset_flags __attribute__((section(".noinit")));
+
+// Runs before the RAM is initialised. After a watchdog reset the watchdog
+// stays enabled at the shortest timeout, it has to be stopped before the
+// (slow) initialisation or the controller keeps resetting.
+void watchdog_early(void) __attribute__((naked, used, section(".init3")));
+void watchdog_early(void)
+{
+	reset_flags = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+// The first timeout raises this interrupt instead of resetting (the hardware
+// clears WDIE, a second timeout would reset). Take down the state of the hung
+// robot and reset right away. If the hang is in a section with interrupts
+// disabled, the second timeout resets without a record.
+ISR(WDT_vect)
+{
+	unsigned long now = millis();
+	unsigned long age = now - scheduler_now();
+
+	crash_record.Task = scheduler_getRunning();
+	crash_record.Missing = scheduler_getMissingHeartbeats();
+	crash_record.Command = bioloid_command;
+	crash_record.LastCommand = last_bioloid_command;
+	crash_record.Page = current_motion_page;
+	crash_record.Step = current_step;
+	crash_record.BusUsing = giBusUsing;
+	crash_record.LoopAge = (age > 0xFFFF) ? 0xFFFF : age;
+	crash_record.Load = scheduler_getLoad();
+	crash_record.Uptime = now;
+	crash_record.Magic = WATCHDOG_RECORD_MAGIC;
+
+	wdt_enable(WDTO_15MS);
+	while(1);
+}
+
+// check the reset cause and print the crash record of a watchdog reset
+// (call once the serial port is up)
+void watchdog_init(void)
+{
+	if( !watchdog_wasReset() ) {
+		crash_record.Magic = 0;
+		return;
+	}
+	if( crash_record.Magic != WATCHDOG_RECORD_MAGIC ) {
+		printf_P(PSTR("\nWatchdog reset - no crash record (hung with interrupts disabled)\n"));
+		return;
+	}
+	printf_P(PSTR("\nWatchdog reset after %lums - "), (unsigned long) crash_record.Uptime);
+	if( crash_record.Task == SCHEDULER_NO_TASK ) {
+		printf_P(PSTR("no task running"));
+	} else {
+		printf_P(PSTR("task %i stuck"), crash_record.Task);
+	}
+	printf_P(PSTR(", tasks without heartbeat 0x%02X\n"), crash_record.Missing);
+	printf_P(PSTR(" command %i (last %i), page %i step %i, bus "),
+			crash_record.Command, crash_record.LastCommand, crash_record.Page,
+			crash_record.Step);
+	if( crash_record.BusUsing ) {
+		printf_P(PSTR("busy\n"));
+	} else {
+		printf_P(PSTR("free\n"));
+	}
+	printf_P(PSTR(" %ums since the last dispatch, load %u.%u%%\n"),
+			crash_record.LoopAge, crash_record.Load / 10, crash_record.Load % 10);
+	// report it only once
+	crash_record.Magic = 0;
+}
+
+// Returns	(bool)	TRUE if the controller was restarted by the watchdog
+bool watchdog_wasReset(void)
+{
+	return (reset_flags & (1<<WDRF)) != 0;
+}
+
+// start the watchdog, from now on the scheduler has to kick it within
+// WATCHDOG_TIMEOUT (only done once every task has finished a slice)
+void watchdog_start(void)
+{
+	wdt_enable(WATCHDOG_TIMEOUT);
+	// interrupt first, so the crash record can be written
+	WDTCSR |= (1<<WDIE);
+}
+
+// stop the watchdog (for commands that block the main loop)
+void watchdog_stop(void)
+{
+	wdt_disable();
+}
+
+// restart the watchdog timeout
+void watchdog_kick(void)
+{
+	wdt_reset();
+}
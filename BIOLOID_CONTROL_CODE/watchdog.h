@@ -0,0 +1,61 @@
+/*
+ * watchdog.h - hardware watchdog fed by the scheduler heartbeats, keeps
+ *	a crash record over the reset and reports it at the next boot
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef WATCHDOG_H_
+#define WATCHDOG_H_
+
+#include "global.h"
+
+// marks a valid crash record (the .noinit RAM holds garbage after power up)
+#define WATCHDOG_RECORD_MAGIC	0xB10C
+
+// state of the robot when the watchdog fired, kept in .noinit RAM
+typedef struct
+{
+	uint16 Magic;				// WATCHDOG_RECORD_MAGIC, written last
+	uint8  Task;				// task that was running, SCHEDULER_NO_TASK if none
+	uint8  Missing;				// tasks without a slice since the last kick (bit mask)
+	uint8  Command;				// bioloid_command
+	uint8  LastCommand;			// last_bioloid_command
+	uint8  Page;				// current motion page
+	uint8  Step;				// current step of the page
+	uint8  BusUsing;			// Dynamixel bus busy (giBusUsing)
+	uint16 LoopAge;				// ms since the last scheduler time snapshot (pass start or refresh)
+	uint16 Load;				// CPU load of the last load window in 0.1%
+	uint32 Uptime;				// millis() when the watchdog fired
+} watchdogCrashRecord;
+
+// check the reset cause and print the crash record of a watchdog reset
+// (call once the serial port is up)
+void watchdog_init(void);
+
+// Returns	(bool)	TRUE if the controller was restarted by the watchdog
+bool watchdog_wasReset(void);
+
+// start the watchdog, from now on the scheduler has to kick it within
+// WATCHDOG_TIMEOUT (only done once every task has finished a slice)
+void watchdog_start(void);
+
+// stop the watchdog (for commands that block the main loop)
+void watchdog_stop(void);
+
+// restart the watchdog timeout
+void watchdog_kick(void);
+
+#endif /* WATCHDOG_H_ */
@@ -0,0 +1,497 @@
+/*
+ * motion_file.cpp - in-memory model of a RoboPlus motion file (.mtn)
+ *	with the parser and the checks against the CM-510 firmware limits
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include "motion_file.h"
+
+// a word of a line with its column (from 1)
+struct Token
+{
+	const char *begin;
+	const char *end;
+	int column;
+};
+
+// parser state for one file
+struct ParseState
+{
+	const std::string &file_name;
+	std::vector<MotionDiagnostic> &diagnostics;
+	int errors;
+	int line;
+};
+
+// add a diagnostic for the current file
+static void addDiagnostic(const std::string &file_name, std::vector<MotionDiagnostic> &diagnostics,
+		int line, int column, bool error, const char *format, va_list args)
+{
+	char message[256];
+
+	vsnprintf(message, sizeof(message), format, args);
+	diagnostics.push_back(MotionDiagnostic { file_name, line, column, error, message });
+}
+
+__attribute__((format(printf, 3, 4)))
+static void parseError(ParseState &state, int column, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	addDiagnostic(state.file_name, state.diagnostics, state.line, column, true, format, args);
+	va_end(args);
+	state.errors++;
+}
+
+__attribute__((format(printf, 3, 4)))
+static void parseWarning(ParseState &state, int column, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	addDiagnostic(state.file_name, state.diagnostics, state.line, column, false, format, args);
+	va_end(args);
+}
+
+// split the value of a line into words separated by blanks
+static void splitTokens(const char *begin, const char *end, int column, std::vector<Token> &tokens)
+{
+	const char *p = begin;
+
+	tokens.clear();
+	while( p < end )
+	{
+		if( *p == ' ' || *p == '\t' ) {
+			p++;
+			continue;
+		}
+		const char *start = p;
+		while( p < end && *p != ' ' && *p != '\t' ) {
+			p++;
+		}
+		tokens.push_back(Token { start, p, column + (int) (start - begin) });
+	}
+}
+
+// Returns	(std::string)	the token text, shortened for messages
+static std::string tokenText(const Token &token)
+{
+	size_t length = token.end - token.begin;
+
+	if( length > 16 ) {
+		return std::string(token.begin, 16) + "...";
+	}
+	return std::string(token.begin, length);
+}
+
+// parse an integer token and check its range
+// Returns	(bool)	true if the token is a number in min..max
+static bool parseInteger(ParseState &state, const Token &token, int min, int max, const char *what, int &value)
+{
+	std::from_chars_result result = std::from_chars(token.begin, token.end, value);
+
+	if( result.ec != std::errc() || result.ptr != token.end ) {
+		parseError(state, token.column, "%s '%s' is not an integer", what, tokenText(token).c_str());
+		return false;
+	}
+	if( value < min || value > max ) {
+		parseError(state, token.column, "%s %i out of range %i..%i", what, value, min, max);
+		return false;
+	}
+	return true;
+}
+
+// parse a time or speed rate token, it has to be a positive number or 0
+// Returns	(bool)	true if the token is valid
+static bool parseDecimal(ParseState &state, const Token &token, const char *what, double &value)
+{
+	std::from_chars_result result = std::from_chars(token.begin, token.end, value);
+
+	if( result.ec != std::errc() || result.ptr != token.end || !std::isfinite(value) ) {
+		parseError(state, token.column, "%s '%s' is not a number", what, tokenText(token).c_str());
+		return false;
+	}
+	if( value < 0 ) {
+		parseError(state, token.column, "%s %s is negative", what, tokenText(token).c_str());
+		return false;
+	}
+	return true;
+}
+
+// check the number of words on a line
+// Returns	(bool)	true if there are exactly count words
+static bool checkTokenCount(ParseState &state, const std::vector<Token> &tokens, size_t count,
+		int end_column, const char *what)
+{
+	if( tokens.size() > count ) {
+		parseError(state, tokens[count].column, "%s has %zu values, expected %zu", what, tokens.size(), count);
+		return false;
+	}
+	if( tokens.size() < count ) {
+		parseError(state, end_column, "%s has %zu values, expected %zu", what, tokens.size(), count);
+		return false;
+	}
+	return true;
+}
+
+// enable=  one flag (0 or 1) per servo slot
+static void parseEnableLine(ParseState &state, const std::vector<Token> &tokens, int end_column, MotionFile &motion)
+{
+	int flag;
+
+	motion.enable_line = state.line;
+	if( !checkTokenCount(state, tokens, MTN_SERVO_SLOTS, end_column, "enable line") ) {
+		return;
+	}
+	for (int i=0; i<MTN_SERVO_SLOTS; i++)
+	{
+		if( !parseInteger(state, tokens[i], 0, 1, "enable flag", flag) ) {
+			flag = 0;
+		}
+		motion.enabled.push_back((uint8_t) flag);
+		if( flag ) {
+			motion.servo_ids.push_back((uint8_t) i);
+		}
+	}
+}
+
+// compliance=  joint flexibility of each servo slot
+static void parseComplianceLine(ParseState &state, const std::vector<Token> &tokens, int end_column,
+		const MotionFile &motion, MotionPage &page)
+{
+	int value;
+
+	if( !checkTokenCount(state, tokens, MTN_SERVO_SLOTS, end_column, "compliance line") ) {
+		return;
+	}
+	for (uint8_t id : motion.servo_ids)
+	{
+		if( parseInteger(state, tokens[id], 0, 255, "compliance", value) ) {
+			page.flexibility.push_back((uint8_t) value);
+		}
+	}
+}
+
+// play_param=  next page, exit page, repeat time, speed rate, inertial force
+static void parsePlayParamLine(ParseState &state, const std::vector<Token> &tokens, int end_column, MotionPage &page)
+{
+	page.param_line = state.line;
+	if( !checkTokenCount(state, tokens, 5, end_column, "play_param line") ) {
+		return;
+	}
+	parseInteger(state, tokens[0], 0, MTN_PAGES, "next page", page.next_page);
+	parseInteger(state, tokens[1], 0, MTN_PAGES, "exit page", page.exit_page);
+	parseInteger(state, tokens[2], 0, 255, "repeat time", page.repeat_time);
+	if( parseDecimal(state, tokens[3], "speed rate", page.speed_rate) && pageSpeedRate10(page) > 255 ) {
+		parseError(state, tokens[3].column, "speed rate %s too high (max 25.5)", tokenText(tokens[3]).c_str());
+	}
+	parseInteger(state, tokens[4], 0, 255, "inertial force", page.inertial_force);
+}
+
+// step=  goal position of each servo slot, pause time, play time
+static void parseStepLine(ParseState &state, const std::vector<Token> &tokens, int end_column,
+		const MotionFile &motion, MotionPage &page)
+{
+	MotionStep step;
+	int value;
+
+	step.line = state.line;
+	if( !checkTokenCount(state, tokens, MTN_SERVO_SLOTS + 2, end_column, "step line") ) {
+		return;
+	}
+	// the values of disabled servos are not used
+	for (uint8_t id : motion.servo_ids)
+	{
+		if( parseInteger(state, tokens[id], 0, MTN_MAX_VALUE, "servo value", value) ) {
+			step.values.push_back((uint16_t) value);
+		}
+	}
+	if( parseDecimal(state, tokens[MTN_SERVO_SLOTS], "pause time", step.pause) &&
+		parseDecimal(state, tokens[MTN_SERVO_SLOTS+1], "play time", step.play) &&
+		step.values.size() == motion.servo_ids.size() ) {
+		page.steps.push_back(step);
+	}
+}
+
+// parse the text of a motion file, problems are appended to diagnostics
+// Returns	(bool)	true if there were no errors
+bool parseMotionText(const std::string &text, const std::string &file_name,
+		MotionFile &motion, std::vector<MotionDiagnostic> &diagnostics)
+{
+	ParseState state { file_name, diagnostics, 0, 0 };
+	std::vector<Token> tokens;
+	MotionPage *page = nullptr;
+	bool header = true;
+	size_t position = 0;
+
+	motion = MotionFile();
+	motion.file_name = file_name;
+	motion.enable_line = 0;
+	// skip a UTF-8 byte order mark
+	if( text.compare(0, 3, "\xEF\xBB\xBF") == 0 ) {
+		position = 3;
+	}
+
+	while( position < text.size() && state.errors < MTN_MAX_ERRORS )
+	{
+		size_t line_end = text.find('\n', position);
+		if( line_end == std::string::npos ) {
+			line_end = text.size();
+		}
+		const char *begin = text.data() + position;
+		const char *end = text.data() + line_end;
+		position = line_end + 1;
+		state.line++;
+
+		// blank lines and CR LF line ends are fine
+		int column = 1;
+		while( begin < end && (*begin == ' ' || *begin == '\t') ) {
+			begin++;
+			column++;
+		}
+		while( end > begin && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t') ) {
+			end--;
+		}
+		if( begin == end ) {
+			continue;
+		}
+		int end_column = column + (int) (end - begin);
+
+		// every line is key=value or a page_begin / page_end marker
+		const char *equals = (const char *) memchr(begin, '=', end - begin);
+		std::string key(begin, equals != nullptr ? equals : end);
+		const char *value = (equals != nullptr) ? equals + 1 : end;
+		int value_column = column + (int) (value - begin);
+
+		// the first line identifies the file
+		if( header ) {
+			header = false;
+			if( key != "type" || std::string(value, end) != "motion" ) {
+				parseError(state, column, "not a motion file (expected 'type=motion')");
+				return false;
+			}
+			continue;
+		}
+
+		if( key == "page_begin" && equals == nullptr )
+		{
+			if( page != nullptr ) {
+				parseError(state, column, "page_end missing for page %zu (begins at line %i)",
+						motion.pages.size(), page->line);
+			}
+			if( motion.enable_line == 0 ) {
+				parseError(state, column, "page_begin before the enable line");
+				return false;
+			}
+			if( motion.pages.size() == MTN_PAGES ) {
+				parseError(state, column, "more than %i pages", MTN_PAGES);
+			}
+			motion.pages.emplace_back();
+			page = &motion.pages.back();
+			page->line = state.line;
+			page->param_line = 0;
+			page->next_page = page->exit_page = page->repeat_time = page->inertial_force = 0;
+			page->speed_rate = 1.0;
+		}
+		else if( key == "page_end" && equals == nullptr )
+		{
+			if( page == nullptr ) {
+				parseError(state, column, "page_end without page_begin");
+				continue;
+			}
+			if( page->flexibility.size() != motion.servo_ids.size() ) {
+				parseError(state, column, "page %zu has no valid compliance line", motion.pages.size());
+			}
+			if( page->param_line == 0 ) {
+				parseError(state, column, "page %zu has no play_param line", motion.pages.size());
+			}
+			page = nullptr;
+		}
+		else if( equals == nullptr )
+		{
+			parseError(state, column, "'%s' is not a key=value line", key.c_str());
+		}
+		else if( page == nullptr )
+		{
+			// file header lines
+			if( key == "version" ) {
+				motion.version.assign(value, end);
+				if( motion.version != "1.0" && motion.version != "1.01" ) {
+					parseWarning(state, value_column, "unknown file version %s", motion.version.c_str());
+				}
+			} else if( key == "enable" ) {
+				if( motion.enable_line != 0 ) {
+					parseError(state, column, "second enable line (first at line %i)", motion.enable_line);
+					continue;
+				}
+				splitTokens(value, end, value_column, tokens);
+				parseEnableLine(state, tokens, end_column, motion);
+			} else if( key == "motor_type" ) {
+				// version 1.01 motor types are not used
+			} else if( key == "name" || key == "compliance" || key == "play_param" || key == "step" ) {
+				parseError(state, column, "'%s' outside of a page", key.c_str());
+			} else {
+				parseWarning(state, column, "unknown line '%s' ignored", key.c_str());
+			}
+		}
+		else
+		{
+			// page lines, in any order
+			if( key == "name" ) {
+				page->name.assign(value, end);
+			} else if( key == "compliance" ) {
+				if( !page->flexibility.empty() ) {
+					parseError(state, column, "second compliance line in page %zu", motion.pages.size());
+					continue;
+				}
+				splitTokens(value, end, value_column, tokens);
+				parseComplianceLine(state, tokens, end_column, motion, *page);
+			} else if( key == "play_param" ) {
+				if( page->param_line != 0 ) {
+					parseError(state, column, "second play_param line in page %zu", motion.pages.size());
+					continue;
+				}
+				splitTokens(value, end, value_column, tokens);
+				parsePlayParamLine(state, tokens, end_column, *page);
+			} else if( key == "step" ) {
+				splitTokens(value, end, value_column, tokens);
+				parseStepLine(state, tokens, end_column, motion, *page);
+			} else {
+				parseWarning(state, column, "unknown line '%s' ignored", key.c_str());
+			}
+		}
+	}
+
+	if( state.errors >= MTN_MAX_ERRORS ) {
+		parseError(state, 0, "too many errors, giving up");
+		return false;
+	}
+	if( header ) {
+		parseError(state, 0, "empty file");
+	} else if( motion.enable_line == 0 ) {
+		parseError(state, 0, "enable line missing");
+	} else if( page != nullptr ) {
+		parseError(state, 0, "page_end missing for page %zu (begins at line %i)", motion.pages.size(), page->line);
+	}
+	return state.errors == 0;
+}
+
+// read and parse a motion file
+// Returns	(bool)	true if there were no errors
+bool readMotionFile(const std::string &file_name, MotionFile &motion,
+		std::vector<MotionDiagnostic> &diagnostics)
+{
+	std::string text;
+	char buffer[65536];
+	size_t length;
+	FILE *in = fopen(file_name.c_str(), "rb");
+
+	if( in == nullptr ) {
+		diagnostics.push_back(MotionDiagnostic { file_name, 0, 0, true, std::string("can't open file: ") + strerror(errno) });
+		return false;
+	}
+	while( (length = fread(buffer, 1, sizeof(buffer), in)) > 0 ) {
+		text.append(buffer, length);
+	}
+	fclose(in);
+	return parseMotionText(text, file_name, motion, diagnostics);
+}
+
+// Returns	(int)	page speed rate times 10 as stored for the firmware (0 or 10 means 1.0x)
+int pageSpeedRate10(const MotionPage &page)
+{
+	return (int) (page.speed_rate * 10 + 0.5);
+}
+
+// Returns	(long)	step time in ms with the page speed rate applied (prescaled times)
+long scaledStepTime(double seconds, int speed_rate10)
+{
+	long time = (long) (seconds * 1000 + 0.5);
+
+	if( speed_rate10 != 0 && speed_rate10 != 10 ) {
+		time = (time * 10) / speed_rate10;
+	}
+	return time;
+}
+
+// check a parsed motion file against the firmware limits
+// Returns	(bool)	true if there were no errors (warnings are fine)
+bool validateMotionFile(const MotionFile &motion, std::vector<MotionDiagnostic> &diagnostics)
+{
+	ParseState state { motion.file_name, diagnostics, 0, 0 };
+
+	state.line = motion.enable_line;
+	if( motion.servo_ids.empty() ) {
+		parseError(state, 0, "no servos enabled");
+	}
+	if( motion.pages.size() != MTN_PAGES ) {
+		state.line = 0;
+		parseWarning(state, 0, "%zu pages instead of %i", motion.pages.size(), MTN_PAGES);
+	}
+
+	for (size_t i=0; i<motion.pages.size(); i++)
+	{
+		const MotionPage &page = motion.pages[i];
+		int number = (int) i + 1;
+		int speed_rate10 = pageSpeedRate10(page);
+
+		if( page.steps.size() > MTN_MAX_STEPS ) {
+			state.line = page.steps[MTN_MAX_STEPS].line;
+			parseError(state, 0, "page %i has %zu steps, the firmware plays at most %i",
+					number, page.steps.size(), MTN_MAX_STEPS);
+		}
+		for (const MotionStep &step : page.steps)
+		{
+			state.line = step.line;
+			if( scaledStepTime(step.pause, speed_rate10) > MTN_MAX_TIME ||
+				scaledStepTime(step.play, speed_rate10) > MTN_MAX_TIME ) {
+				parseError(state, 0, "step time above %i ms with the page speed rate", MTN_MAX_TIME);
+			}
+		}
+		// jumps to empty pages stop the motion
+		state.line = page.param_line;
+		if( !page.steps.empty() && page.next_page != 0 &&
+			(page.next_page > (int) motion.pages.size() || motion.pages[page.next_page-1].steps.empty()) ) {
+			parseWarning(state, 0, "page %i continues with empty page %i", number, page.next_page);
+		}
+		if( !page.steps.empty() && page.exit_page != 0 &&
+			(page.exit_page > (int) motion.pages.size() || motion.pages[page.exit_page-1].steps.empty()) ) {
+			parseWarning(state, 0, "page %i exits to empty page %i", number, page.exit_page);
+		}
+	}
+	return state.errors == 0;
+}
+
+// Returns	(std::string)	diagnostic as "file:line:column: error: message"
+std::string formatDiagnostic(const MotionDiagnostic &diagnostic)
+{
+	std::string text = diagnostic.file;
+
+	if( diagnostic.line > 0 ) {
+		text += ":" + std::to_string(diagnostic.line);
+		if( diagnostic.column > 0 ) {
+			text += ":" + std::to_string(diagnostic.column);
+		}
+	}
+	text += diagnostic.error ? ": error: " : ": warning: ";
+	return text + diagnostic.message;
+}
@@ -0,0 +1,102 @@
+/*
+ * motion_file.h - in-memory model of a RoboPlus motion file (.mtn)
+ *	with the parser and the checks against the CM-510 firmware limits
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MOTION_FILE_H_
+#define MOTION_FILE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// limits of the motion file format and the firmware (global.h, motion_f.h)
+#define MTN_SERVO_SLOTS		26		// MAX_AX12_SERVOS, entries of enable, compliance and step lines
+#define MTN_PAGES			255		// RoboPlus always writes 255 pages
+#define MTN_MAX_STEPS		7		// MAX_MOTION_STEPS
+#define MTN_MAX_VALUE		1023	// AX-12 goal position
+#define MTN_MAX_TIME		65535	// ms, times are uint16 in the firmware
+#define MTN_MAX_ERRORS		50		// the parser gives up after this many errors
+
+// A problem found in a motion file. Line and column count from 1,
+// column 0 means the whole line.
+struct MotionDiagnostic
+{
+	std::string file;
+	int line;
+	int column;
+	bool error;				// false for a warning
+	std::string message;
+};
+
+// one step of a page, values of the active servos only
+struct MotionStep
+{
+	std::vector<uint16_t> values;
+	double pause;			// seconds, as in the file
+	double play;
+	int line;
+};
+
+struct MotionPage
+{
+	std::string name;
+	std::vector<uint8_t> flexibility;	// compliance of the active servos
+	int next_page;
+	int exit_page;
+	int repeat_time;
+	double speed_rate;
+	int inertial_force;
+	std::vector<MotionStep> steps;
+	int line;				// page_begin
+	int param_line;			// play_param
+};
+
+struct MotionFile
+{
+	std::string file_name;
+	std::string version;
+	std::vector<uint8_t> enabled;		// enable flag of each servo slot
+	std::vector<uint8_t> servo_ids;		// Dynamixel IDs of the active servos
+	int enable_line;
+	std::vector<MotionPage> pages;		// page 1 is pages[0]
+};
+
+// parse the text of a motion file, problems are appended to diagnostics
+// Returns	(bool)	true if there were no errors
+bool parseMotionText(const std::string &text, const std::string &file_name,
+		MotionFile &motion, std::vector<MotionDiagnostic> &diagnostics);
+
+// read and parse a motion file
+// Returns	(bool)	true if there were no errors
+bool readMotionFile(const std::string &file_name, MotionFile &motion,
+		std::vector<MotionDiagnostic> &diagnostics);
+
+// check a parsed motion file against the firmware limits
+// Returns	(bool)	true if there were no errors (warnings are fine)
+bool validateMotionFile(const MotionFile &motion, std::vector<MotionDiagnostic> &diagnostics);
+
+// Returns	(std::string)	diagnostic as "file:line:column: error: message"
+std::string formatDiagnostic(const MotionDiagnostic &diagnostic);
+
+// Returns	(int)	page speed rate times 10 as stored for the firmware (0 or 10 means 1.0x)
+int pageSpeedRate10(const MotionPage &page);
+
+// Returns	(long)	step time in ms with the page speed rate applied (prescaled times)
+long scaledStepTime(double seconds, int speed_rate10);
+
+#endif /* MOTION_FILE_H_ */
@@ -0,0 +1,512 @@
+/*
+ * motion_output.cpp - motion.h header, delta encoded pages and binary
+ *	motion image for the CM-510 firmware from a parsed motion file
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include "motion_output.h"
+
+// speed model of calculatePoseServoSpeeds() in pose.c
+#define SPEED_FACTOR	848		// ms * speed units per position unit (59 RPM)
+#define MAX_SPEED		1023
+#define MIN_SPEED		26
+
+// append a number to the header text
+static void appendNumber(std::string &text, long value)
+{
+	text += std::to_string(value);
+}
+
+// append a list of numbers separated by commas
+template <typename T>
+static void appendList(std::string &text, const T *values, size_t count)
+{
+	for (size_t i=0; i<count; i++) {
+		if( i != 0 ) {
+			text += ',';
+		}
+		appendNumber(text, values[i]);
+	}
+}
+
+// append a little endian uint16
+static void appendWord(std::vector<uint8_t> &bytes, uint32_t value)
+{
+	bytes.push_back(value & 0xFF);
+	bytes.push_back((value >> 8) & 0xFF);
+}
+
+// page names go into // comments, keep them on one line
+static std::string commentText(const std::string &name)
+{
+	std::string text = name;
+
+	for (char &c : text) {
+		if( c == '\\' || (unsigned char) c < ' ' ) {
+			c = ' ';
+		}
+	}
+	return text;
+}
+
+// Delta encode the servo values of the steps of one page
+// Keyframe steps:  marker byte 0xFF followed by each value as high byte, low byte
+// Other steps:     tokens for the change of each value from the previous step
+//   0xxxxxxx            one delta, zigzag encoded in 7 bits (-64..63)
+//   10nnnnnn            run of nnnnnn+1 unchanged values (1..64)
+//   11xxxxxx xxxxxxxx   one delta, zigzag encoded in 14 bits
+void encodeDeltaSteps(const std::vector<MotionStep> &steps, std::vector<uint8_t> &bytes)
+{
+	for (size_t s=0; s<steps.size(); s++)
+	{
+		const std::vector<uint16_t> &values = steps[s].values;
+
+		if( (s % MTN_KEYFRAME_INTERVAL) == 0 ) {
+			bytes.push_back(MTN_KEYFRAME_MARKER);
+			for (uint16_t value : values) {
+				bytes.push_back((value >> 8) & 0xFF);
+				bytes.push_back(value & 0xFF);
+			}
+			continue;
+		}
+		const std::vector<uint16_t> &previous = steps[s-1].values;
+		int run = 0;
+		for (size_t k=0; k<values.size(); k++)
+		{
+			int delta = values[k] - previous[k];
+			if( delta == 0 ) {
+				run++;
+				if( run == 64 ) {
+					bytes.push_back(0x80 | (run-1));
+					run = 0;
+				}
+				continue;
+			}
+			if( run > 0 ) {
+				bytes.push_back(0x80 | (run-1));
+				run = 0;
+			}
+			int zigzag = (delta >= 0) ? (delta << 1) : ((-delta << 1) - 1);
+			if( zigzag < 128 ) {
+				bytes.push_back(zigzag);
+			} else {
+				bytes.push_back(0xC0 | ((zigzag >> 8) & 0x3F));
+				bytes.push_back(zigzag & 0xFF);
+			}
+		}
+		if( run > 0 ) {
+			bytes.push_back(0x80 | (run-1));
+		}
+	}
+}
+
+// CRC16 as calculated by avr-libc _crc16_update (polynomial 0xA001, init 0xFFFF)
+// Returns	(uint16_t)	CRC of the data
+uint16_t motionCrc16(const uint8_t *data, size_t length)
+{
+	uint16_t crc = 0xFFFF;
+
+	for (size_t i=0; i<length; i++)
+	{
+		crc ^= data[i];
+		for (int b=0; b<8; b++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+		}
+	}
+	return crc;
+}
+
+// prescaled times and the precomputed step times and servo speeds of a page
+static void compilePage(const MotionFile &motion, CompiledPage &compiled)
+{
+	const MotionPage &page = *compiled.page;
+	size_t servos = motion.servo_ids.size();
+
+	compiled.speed_rate10 = pageSpeedRate10(page);
+	for (const MotionStep &step : page.steps) {
+		compiled.pause_times.push_back((uint16_t) scaledStepTime(step.pause, compiled.speed_rate10));
+	}
+	for (const MotionStep &step : page.steps) {
+		compiled.play_times.push_back((uint16_t) scaledStepTime(step.play, compiled.speed_rate10));
+	}
+
+	// The start pose of steps 2..n is the previous step (same model as
+	// calculatePoseServoSpeeds in pose.c). The speeds are stored as speed/4
+	// rounded up in a byte, the first step is calculated live.
+	compiled.step_times.push_back(0);
+	for (size_t s=1; s<page.steps.size(); s++)
+	{
+		const std::vector<uint16_t> &values = page.steps[s].values;
+		const std::vector<uint16_t> &previous = page.steps[s-1].values;
+		long max_travel = 0;
+
+		for (size_t k=0; k<servos; k++) {
+			max_travel = std::max(max_travel, (long) std::abs(values[k] - previous[k]));
+		}
+		long time = compiled.play_times[s];
+		long min_time = (SPEED_FACTOR * max_travel + MAX_SPEED - 1) / MAX_SPEED;
+		if( time < min_time ) {
+			time = min_time;
+		}
+		if( time == 0 ) {
+			time = 1;
+		}
+		compiled.step_times.push_back((uint16_t) time);
+		for (size_t k=0; k<servos; k++)
+		{
+			long speed = (SPEED_FACTOR * (long) std::abs(values[k] - previous[k])) / time;
+			speed = std::min(std::max(speed, (long) MIN_SPEED), (long) MAX_SPEED);
+			compiled.step_speeds.push_back((uint8_t) std::min((speed + 3) / 4, 255L));
+		}
+	}
+
+	// The delta encoded byte layout (used by -d and the motion image): the header
+	// is the same as the struct, but the times come before the variable length steps
+	compiled.bytes = page.flexibility;
+	compiled.bytes.push_back(page.next_page);
+	compiled.bytes.push_back(page.exit_page);
+	compiled.bytes.push_back(page.repeat_time);
+	compiled.bytes.push_back(compiled.speed_rate10);
+	compiled.bytes.push_back(page.inertial_force);
+	compiled.bytes.push_back(page.steps.size());
+	for (uint16_t time : compiled.pause_times) {
+		appendWord(compiled.bytes, time);
+	}
+	for (uint16_t time : compiled.play_times) {
+		appendWord(compiled.bytes, time);
+	}
+	for (uint16_t time : compiled.step_times) {
+		appendWord(compiled.bytes, time);
+	}
+	compiled.bytes.insert(compiled.bytes.end(), compiled.step_speeds.begin(), compiled.step_speeds.end());
+	encodeDeltaSteps(page.steps, compiled.bytes);
+}
+
+// calculate everything the outputs need from a validated motion file
+void compileMotion(const MotionFile &motion, CompiledMotion &compiled)
+{
+	size_t servos = motion.servo_ids.size();
+	long packed_servos = (servos + 2) / 3;
+
+	compiled.motion = &motion;
+	compiled.pages.clear();
+	compiled.min_values.assign(servos, 512);
+	compiled.max_values.assign(servos, 512);
+	compiled.total_steps = 0;
+	compiled.max_steps = 0;
+	compiled.last_page = 0;
+	compiled.delta_bytes = 0;
+
+	for (size_t i=0; i<motion.pages.size(); i++)
+	{
+		const MotionPage &page = motion.pages[i];
+		int steps = (int) page.steps.size();
+
+		compiled.total_steps += steps;
+		compiled.max_steps = std::max(compiled.max_steps, steps);
+		if( steps == 0 ) {
+			continue;
+		}
+		compiled.last_page = (int) i + 1;
+		for (const MotionStep &step : page.steps) {
+			for (size_t k=0; k<servos; k++) {
+				compiled.min_values[k] = std::min(compiled.min_values[k], step.values[k]);
+				compiled.max_values[k] = std::max(compiled.max_values[k], step.values[k]);
+			}
+		}
+		compiled.pages.emplace_back();
+		CompiledPage &compiled_page = compiled.pages.back();
+		compiled_page.number = (int) i + 1;
+		compiled_page.page = &page;
+		compilePage(motion, compiled_page);
+		compiled.delta_bytes += compiled_page.bytes.size();
+	}
+
+	// Flash use of the struct pages: values, pause, play and step times of each
+	// step, the page header and the speeds of steps 2..n
+	long total_pages = compiled.pages.size();
+	compiled.packed_bytes = compiled.total_steps * (packed_servos*4 + 2 + 2 + 2);
+	compiled.packed_bytes += total_pages * (servos + 6);
+	compiled.packed_bytes += (compiled.total_steps - total_pages) * servos;
+}
+
+// Returns	(long)	Flash use checked by the firmware at compile time (MOTION_FILE_BYTES)
+long motionFlashBytes(const CompiledMotion &compiled, bool delta_mode)
+{
+	// plus the page index
+	return (delta_mode ? compiled.delta_bytes : compiled.packed_bytes) + 256 + 2 * (long) compiled.pages.size();
+}
+
+// one page as a packed struct, three 11 bit servo values per uint32
+static void appendStructPage(std::string &text, const CompiledMotion &compiled, const CompiledPage &page)
+{
+	const MotionPage &motion_page = *page.page;
+	size_t servos = compiled.motion->servo_ids.size();
+	size_t packed_servos = (servos + 2) / 3;
+	size_t steps = motion_page.steps.size();
+	std::string count = std::to_string(steps);
+
+	text += "struct // " + commentText(motion_page.name) + " \n";
+	text += "{ \n";
+	text += "   const uint8 JointFlexibility[" + std::to_string(servos) + "]; \n";
+	text += "   const uint8 NextPage; \n";
+	text += "   const uint8 ExitPage; \n";
+	text += "   const uint8 RepeatTime; \n";
+	text += "   const uint8 SpeedRate10; \n";
+	text += "   const uint8 InertialForce; \n";
+	text += "   const uint8 Steps; \n";
+	text += "   const uint32 StepValues[" + count + "][" + std::to_string(packed_servos) + "]; \n";
+	text += "   const uint16 PauseTime[" + count + "]; \n";
+	text += "   const uint16 PlayTime[" + count + "]; \n";
+	text += "   const uint16 StepTime[" + count + "]; \n";
+	if( steps > 1 ) {
+		text += "   const uint8 StepSpeeds[" + std::to_string(steps-1) + "][" + std::to_string(servos) + "]; \n";
+	}
+	text += "} MotionPage" + std::to_string(page.number) + " PROGMEM = { \n";
+
+	text += "{";
+	appendList(text, motion_page.flexibility.data(), servos);
+	text += "}, \n";
+	text += std::to_string(motion_page.next_page) + ", " + std::to_string(motion_page.exit_page) + ", " +
+			std::to_string(motion_page.repeat_time) + ", " + std::to_string(page.speed_rate10) + ", " +
+			std::to_string(motion_page.inertial_force) + ", " + count + ", \n";
+
+	text += "{{";
+	for (size_t s=0; s<steps; s++)
+	{
+		const std::vector<uint16_t> &values = motion_page.steps[s].values;
+		for (size_t k=0; k<packed_servos; k++)
+		{
+			uint32_t packed = 0;
+			for (size_t n=3*k; n<3*k+3 && n<servos; n++) {
+				packed += (uint32_t) values[n] << (22 - 11*(n - 3*k));
+			}
+			appendNumber(text, packed);
+			if( k != packed_servos-1 ) {
+				text += ',';
+			}
+		}
+		text += (s != steps-1) ? "},\n {" : "}}, \n";
+	}
+
+	text += "{";
+	appendList(text, page.pause_times.data(), steps);
+	text += "}, {";
+	appendList(text, page.play_times.data(), steps);
+	text += "}, \n";
+	text += "{";
+	appendList(text, page.step_times.data(), steps);
+	text += "}";
+	if( steps > 1 ) {
+		text += ", \n{";
+		for (size_t s=0; s<steps-1; s++) {
+			text += "{";
+			appendList(text, page.step_speeds.data() + s*servos, servos);
+			text += (s != steps-2) ? "}," : "}";
+		}
+		text += "}";
+	}
+	text += " \n";
+	text += "}; \n\n";
+}
+
+// one page as a delta encoded byte array
+static void appendDeltaPage(std::string &text, const CompiledPage &page)
+{
+	text += "// " + commentText(page.page->name) + " \n";
+	text += "const uint8 MotionPage" + std::to_string(page.number) + "[] PROGMEM = { \n";
+	for (size_t j=0; j<page.bytes.size(); j++)
+	{
+		appendNumber(text, page.bytes[j]);
+		if( j != page.bytes.size()-1 ) {
+			text += ',';
+		}
+		if( (j % 24) == 23 ) {
+			text += '\n';
+		}
+	}
+	text += "}; \n\n";
+}
+
+// Returns	(std::string)	the motion.h header, the same as MotionParser.pl writes
+std::string motionHeader(const CompiledMotion &compiled, bool delta_mode)
+{
+	const MotionFile &motion = *compiled.motion;
+	size_t servos = motion.servo_ids.size();
+	size_t total_pages = compiled.pages.size();
+	std::string text;
+
+	text.reserve(64 + compiled.delta_bytes * 4 + compiled.packed_bytes * 3);
+	text += "#ifndef __MOTION_H_\n";
+	text += "#define __MOTION_H_\n";
+	text += "/* ==========================================================================\n";
+	text += " \n";
+	text += "   COMPONENT:        Global motion variable definitions\n";
+	text += "   AUTHOR:           Ariel Vernaza\n";
+	text += "   DESCRIPTION:      This component defines the motion pages and related\n";
+	text += "                     global variables. Auto-generated from the *.mtn file.\n";
+	text += " \n";
+	text += "========================================================================== */\n";
+	text += " \n";
+	text += "#include <stdint.h>\n";
+	text += "#include <avr/pgmspace.h>\n";
+	text += "#include \"global.h\"\n";
+	if( delta_mode ) {
+		text += " \n";
+		text += "// Step values are delta encoded (see motion_f.c for the stream format)\n";
+		text += "#define MOTION_DELTA_ENCODED\n";
+		text += "#define MOTION_KEYFRAME_INTERVAL	" + std::to_string(MTN_KEYFRAME_INTERVAL) + "\n";
+	}
+
+	// Array showing which Dynamixel servos are enabled, to test the hardware config
+	text += " \n";
+	text += "// Array showing which Dynamixel servos are enabled in motion file \n";
+	text += "const uint8 AX12_ENABLED[MAX_AX12_SERVOS] = {";
+	appendList(text, motion.enabled.data(), motion.enabled.size());
+	text += "}; \n";
+	text += "\n";
+
+	for (const CompiledPage &page : compiled.pages) {
+		if( delta_mode ) {
+			appendDeltaPage(text, page);
+		} else {
+			appendStructPage(text, compiled, page);
+		}
+	}
+
+	text += "// Number of active motion pages in this file \n";
+	text += "const uint8 ACTIVE_MOTION_PAGES = " + std::to_string(total_pages) + "; \n\n";
+	text += "// Min and max values for the servo values \n";
+	text += "const uint16 SERVO_MAX_VALUES[" + std::to_string(servos) + "] = {";
+	appendList(text, compiled.max_values.data(), servos);
+	text += "}; \n";
+	text += "const uint16 SERVO_MIN_VALUES[" + std::to_string(servos) + "] = {";
+	appendList(text, compiled.min_values.data(), servos);
+	text += "}; \n";
+	text += "\n";
+
+	// metadata of the motion file, checked against global.h at compile time (see motion_f.c)
+	uint16_t min_value = 1023, max_value = 0;
+	for (size_t k=0; k<servos; k++) {
+		min_value = std::min(min_value, compiled.min_values[k]);
+		max_value = std::max(max_value, compiled.max_values[k]);
+	}
+	text += "// Motion file metadata for the compile-time checks \n";
+	text += "#define MOTION_FILE_SERVOS		" + std::to_string(servos) + " \n";
+	text += "#define MOTION_FILE_PAGES		" + std::to_string(total_pages) + " \n";
+	text += "#define MOTION_FILE_LAST_PAGE	" + std::to_string(compiled.last_page) + " \n";
+	text += "#define MOTION_FILE_MAX_STEPS	" + std::to_string(compiled.max_steps) + " \n";
+	text += "#define MOTION_FILE_MIN_VALUE	" + std::to_string(min_value) + " \n";
+	text += "#define MOTION_FILE_MAX_VALUE	" + std::to_string(max_value) + " \n";
+	text += "#define MOTION_FILE_BYTES		" + std::to_string(motionFlashBytes(compiled, delta_mode)) + " \n";
+	text += "// Play and pause times already include the page speed rate \n";
+	text += "#define MOTION_TIMES_PRESCALED \n";
+	text += "\n";
+
+	// the page index: a page number to slot table and a dense table of page addresses
+	text += "// Motion page index - slot in MOTION_PAGE_TABLE for each page number \n";
+	text += "#define MOTION_PAGE_NONE	0xFF \n";
+	text += "const uint8 MOTION_PAGE_INDEX[256] PROGMEM = { \n";
+	std::vector<int> page_slot(256, -1);
+	for (size_t j=0; j<total_pages; j++) {
+		page_slot[compiled.pages[j].number] = (int) j;
+	}
+	for (int j=0; j<256; j++)
+	{
+		if( page_slot[j] >= 0 ) {
+			appendNumber(text, page_slot[j]);
+		} else {
+			text += "MOTION_PAGE_NONE";
+		}
+		if( j != 255 ) {
+			text += ',';
+		}
+		if( (j % 16) == 15 ) {
+			text += '\n';
+		}
+	}
+	text += "}; \n";
+	text += "// Flash address of each active motion page \n";
+	text += "const uint8 * const MOTION_PAGE_TABLE[" + std::to_string(total_pages) + "] PROGMEM = { \n";
+	for (size_t j=0; j<total_pages; j++)
+	{
+		text += delta_mode ? "(const uint8 *) MotionPage" : "(const uint8 *) &MotionPage";
+		appendNumber(text, compiled.pages[j].number);
+		if( j != total_pages-1 ) {
+			text += ',';
+		}
+		if( (j % 4) == 3 ) {
+			text += '\n';
+		}
+	}
+	text += "}; \n\n";
+	text += "#endif /* MOTION_H_ */";
+	return text;
+}
+
+// Build the binary motion image for the LOAD command (layout see motion_image.h)
+//   header   'B','M','I',version, servos, pages, flags, keyframe interval,
+//            uint32 length, uint16 crc, uint16 reserved
+//   limits   servo min values, servo max values (uint16 each)
+//   index    page number (uint8), page offset from image start (uint16)
+//   pages    delta encoded pages
+// Returns	(bool)	false if the image does not fit a Flash slot
+bool motionImage(const CompiledMotion &compiled, std::vector<uint8_t> &image)
+{
+	size_t servos = compiled.motion->servo_ids.size();
+	size_t offset = MTN_IMAGE_HEADER_SIZE + 4*servos + 3*compiled.pages.size();
+	size_t length = offset + compiled.delta_bytes;
+
+	image.clear();
+	if( length > MTN_IMAGE_SLOT_SIZE ) {
+		return false;
+	}
+	image.reserve(length);
+	image.resize(MTN_IMAGE_HEADER_SIZE);
+	for (uint16_t value : compiled.min_values) {
+		appendWord(image, value);
+	}
+	for (uint16_t value : compiled.max_values) {
+		appendWord(image, value);
+	}
+	for (const CompiledPage &page : compiled.pages) {
+		image.push_back(page.number);
+		appendWord(image, offset);
+		offset += page.bytes.size();
+	}
+	for (const CompiledPage &page : compiled.pages) {
+		image.insert(image.end(), page.bytes.begin(), page.bytes.end());
+	}
+
+	uint16_t crc = motionCrc16(image.data() + MTN_IMAGE_HEADER_SIZE, length - MTN_IMAGE_HEADER_SIZE);
+	image[0] = 'B';
+	image[1] = 'M';
+	image[2] = 'I';
+	image[3] = MTN_IMAGE_VERSION;
+	image[4] = servos;
+	image[5] = compiled.pages.size();
+	image[6] = 1;						// flags: delta encoded pages
+	image[7] = MTN_KEYFRAME_INTERVAL;
+	for (int i=0; i<4; i++) {
+		image[8+i] = (length >> (8*i)) & 0xFF;
+	}
+	image[12] = crc & 0xFF;
+	image[13] = (crc >> 8) & 0xFF;
+	image[14] = 0;
+	image[15] = 0;
+	return true;
+}
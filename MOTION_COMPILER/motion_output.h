@@ -0,0 +1,84 @@
+/*
+ * motion_output.h - motion.h header, delta encoded pages and binary
+ *	motion image for the CM-510 firmware from a parsed motion file
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+
+#ifndef MOTION_OUTPUT_H_
+#define MOTION_OUTPUT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "motion_file.h"
+
+// delta encoding of the step values (see motion_f.c in the firmware)
+#define MTN_KEYFRAME_INTERVAL	4		// the first step of every page is always a keyframe
+#define MTN_KEYFRAME_MARKER		0xFF	// never a valid delta token
+
+// motion image layout, see motion_image.h in the firmware
+#define MTN_IMAGE_VERSION		3		// 3 - prescaled times, step times and speeds
+#define MTN_IMAGE_HEADER_SIZE	16
+#define MTN_IMAGE_SLOT_SIZE		0xF000
+
+// firmware view of a page with steps: prescaled times and the precomputed
+// step times and servo speeds of steps 2..n
+struct CompiledPage
+{
+	int number;
+	const MotionPage *page;
+	int speed_rate10;
+	std::vector<uint16_t> pause_times;		// ms
+	std::vector<uint16_t> play_times;
+	std::vector<uint16_t> step_times;
+	std::vector<uint8_t> step_speeds;		// speed/4 of each servo, steps-1 rows
+	std::vector<uint8_t> bytes;				// delta encoded page (-d and motion image)
+};
+
+struct CompiledMotion
+{
+	const MotionFile *motion;
+	std::vector<CompiledPage> pages;		// pages with steps only
+	std::vector<uint16_t> min_values;		// range of each servo over all steps
+	std::vector<uint16_t> max_values;
+	int total_steps;
+	int max_steps;
+	int last_page;
+	long packed_bytes;						// Flash use of the packed struct pages
+	long delta_bytes;						// Flash use of the delta encoded pages
+};
+
+// delta encode the servo values of the steps of one page
+void encodeDeltaSteps(const std::vector<MotionStep> &steps, std::vector<uint8_t> &bytes);
+
+// CRC16 as calculated by avr-libc _crc16_update (polynomial 0xA001, init 0xFFFF)
+// Returns	(uint16_t)	CRC of the data
+uint16_t motionCrc16(const uint8_t *data, size_t length);
+
+// calculate everything the outputs need from a validated motion file
+void compileMotion(const MotionFile &motion, CompiledMotion &compiled);
+
+// Returns	(long)	Flash use checked by the firmware at compile time (MOTION_FILE_BYTES)
+long motionFlashBytes(const CompiledMotion &compiled, bool delta_mode);
+
+// Returns	(std::string)	the motion.h header, the same as MotionParser.pl writes
+std::string motionHeader(const CompiledMotion &compiled, bool delta_mode);
+
+// build the binary motion image for the LOAD command
+// Returns	(bool)	false if the image does not fit a Flash slot
+bool motionImage(const CompiledMotion &compiled, std::vector<uint8_t> &image);
+
+#endif /* MOTION_OUTPUT_H_ */
@@ -0,0 +1,222 @@
+/*
+ * motionc.cpp - host motion compiler, turns RoboPlus motion files into
+ *	motion.h and motion images for the CM-510 firmware (replaces MotionParser.pl)
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "motion_file.h"
+#include "motion_output.h"
+
+// command-line options
+struct Options
+{
+	bool delta_mode;		// -d  delta encode the step values
+	bool image_mode;		// -b  also write the binary motion image
+	bool check_only;		// -c  only parse and check
+	int jobs;				// -j  motion files processed in parallel
+	std::string output_dir;	// -o  output directory
+};
+
+// one motion file to process and what came out of it
+struct Job
+{
+	std::string input;
+	std::string header_file;
+	std::string image_file;
+	bool ok;
+	std::string log;		// diagnostics and summary, printed in input order
+};
+
+static void printUsage(void)
+{
+	printf("\nUsage: motionc [-d] [-b] [-c] [-j jobs] [-o dir] foo.mtn [bar.mtn ...]\n");
+	printf("       -d  delta encode the step values (saves Flash)\n");
+	printf("       -b  also write the binary motion image\n");
+	printf("       -c  only check the motion files, write nothing\n");
+	printf("       -j  number of files processed in parallel (default: all CPUs)\n");
+	printf("       -o  output directory, outputs are named after the motion file (foo.h, foo.bin)\n");
+	printf("With one motion file and no -o the outputs are motion.h and motion.bin\n");
+	printf("in the current directory, the same files MotionParser.pl writes.\n");
+}
+
+// Returns	(std::string)	file name without directory and extension
+static std::string baseName(const std::string &path)
+{
+	size_t slash = path.find_last_of('/');
+	std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+
+	return (dot == std::string::npos || dot == 0) ? name : name.substr(0, dot);
+}
+
+// write a whole output file
+// Returns	(bool)	true if the file was written
+static bool writeFile(const std::string &file_name, const void *data, size_t length, std::string &log)
+{
+	FILE *out = fopen(file_name.c_str(), "wb");
+
+	if( out == nullptr ) {
+		log += file_name + ": error: can't open output file: " + strerror(errno) + "\n";
+		return false;
+	}
+	bool ok = fwrite(data, 1, length, out) == length;
+	ok = (fclose(out) == 0) && ok;
+	if( !ok ) {
+		log += file_name + ": error: write failed\n";
+	}
+	return ok;
+}
+
+// parse, check and compile one motion file and write its outputs
+static void processJob(const Options &options, Job &job)
+{
+	std::vector<MotionDiagnostic> diagnostics;
+	MotionFile motion;
+	CompiledMotion compiled;
+	std::vector<uint8_t> image;
+
+	job.ok = readMotionFile(job.input, motion, diagnostics);
+	if( job.ok ) {
+		job.ok = validateMotionFile(motion, diagnostics);
+	}
+	if( job.ok ) {
+		compileMotion(motion, compiled);
+		// the firmware checks this at compile time as well (MOTION_FILE_BYTES)
+		long bytes = motionFlashBytes(compiled, options.delta_mode);
+		if( bytes >= 65536 ) {
+			diagnostics.push_back(MotionDiagnostic { job.input, 0, 0, true,
+					"motion pages need " + std::to_string(bytes) + " bytes of Flash, more than 64KB" });
+			job.ok = false;
+		}
+		if( options.image_mode && !motionImage(compiled, image) ) {
+			diagnostics.push_back(MotionDiagnostic { job.input, 0, 0, true,
+					"motion image does not fit a 60KB Flash slot" });
+			job.ok = false;
+		}
+	}
+	for (const MotionDiagnostic &diagnostic : diagnostics) {
+		job.log += formatDiagnostic(diagnostic) + "\n";
+	}
+	if( !job.ok ) {
+		return;
+	}
+
+	std::string summary = job.input + ": " + std::to_string(compiled.pages.size()) + " pages, " +
+			std::to_string(compiled.total_steps) + " steps, " +
+			std::to_string(motionFlashBytes(compiled, options.delta_mode)) + " bytes";
+	if( options.check_only ) {
+		job.log += summary + "\n";
+		return;
+	}
+	std::string header = motionHeader(compiled, options.delta_mode);
+	job.ok = writeFile(job.header_file, header.data(), header.size(), job.log);
+	if( job.ok && options.image_mode ) {
+		job.ok = writeFile(job.image_file, image.data(), image.size(), job.log);
+	}
+	if( job.ok ) {
+		job.log += summary + " -> " + job.header_file;
+		if( options.image_mode ) {
+			job.log += ", " + job.image_file + " (" + std::to_string(image.size()) + " bytes)";
+		}
+		job.log += "\n";
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Options options { false, false, false, 0, "" };
+	std::vector<Job> jobs;
+	int arg = 1;
+
+	for ( ; arg < argc && argv[arg][0] == '-'; arg++)
+	{
+		if( strcmp(argv[arg], "-d") == 0 ) {
+			options.delta_mode = true;
+		} else if( strcmp(argv[arg], "-b") == 0 ) {
+			options.image_mode = true;
+		} else if( strcmp(argv[arg], "-c") == 0 ) {
+			options.check_only = true;
+		} else if( strcmp(argv[arg], "-j") == 0 && arg+1 < argc ) {
+			options.jobs = atoi(argv[++arg]);
+		} else if( strcmp(argv[arg], "-o") == 0 && arg+1 < argc ) {
+			options.output_dir = argv[++arg];
+		} else {
+			printUsage();
+			return 2;
+		}
+	}
+	if( arg == argc ) {
+		printUsage();
+		return 2;
+	}
+
+	// output file names, motion.h / motion.bin for a single file without -o
+	bool named_outputs = (argc - arg > 1) || !options.output_dir.empty();
+	std::string dir = options.output_dir.empty() ? "" : options.output_dir + "/";
+	for ( ; arg < argc; arg++)
+	{
+		Job job;
+		job.input = argv[arg];
+		job.ok = false;
+		std::string name = named_outputs ? baseName(job.input) : "motion";
+		job.header_file = dir + name + ".h";
+		job.image_file = dir + name + ".bin";
+		jobs.push_back(job);
+	}
+
+	// work through the motion files in parallel, each thread takes the next file
+	unsigned int threads = (options.jobs > 0) ? options.jobs : std::thread::hardware_concurrency();
+	if( threads == 0 ) {
+		threads = 1;
+	}
+	if( threads > jobs.size() ) {
+		threads = jobs.size();
+	}
+	std::atomic<size_t> next_job(0);
+	auto worker = [&]() {
+		for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+			processJob(options, jobs[i]);
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned int i=1; i<threads; i++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (std::thread &thread : pool) {
+		thread.join();
+	}
+
+	int failed = 0;
+	for (const Job &job : jobs)
+	{
+		fputs(job.log.c_str(), job.ok ? stdout : stderr);
+		if( !job.ok ) {
+			failed++;
+		}
+	}
+	if( failed > 0 ) {
+		fprintf(stderr, "%i of %zu motion files failed\n", failed, jobs.size());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# check_equivalence.sh - compare the outputs of motionc and MotionParser.pl
+#
+# Usage: check_equivalence.sh motionc MotionParser.pl foo.mtn [bar.mtn ...]
+#
+# Every file is compiled by both in all four modes (plain, -d, -b, -d -b) and
+# motion.h and motion.bin have to be byte for byte the same. MotionParser.pl
+# only handles complete files as RoboPlus writes them (255 pages), use such
+# files here, motionc accepts shorter ones with a warning. Use LF line ends,
+# MotionParser.pl copies the CR of CRLF files into motion.h.
+
+if [ $# -lt 3 ]; then
+	echo "Usage: $0 motionc MotionParser.pl foo.mtn [bar.mtn ...]"
+	exit 1
+fi
+
+motionc=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+parser=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+shift 2
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+for file in "$@"; do
+	mtn=$(cd "$(dirname "$file")" && pwd)/$(basename "$file")
+	for mode in "" "-d" "-b" "-d -b"; do
+		rm -rf "$work/c" "$work/p"
+		mkdir "$work/c" "$work/p"
+		(cd "$work/c" && "$motionc" $mode "$mtn" > /dev/null 2>&1)
+		(cd "$work/p" && perl "$parser" $mode "$mtn" > /dev/null 2>&1)
+		for output in motion.h motion.bin; do
+			if [ -f "$work/p/$output" ] || [ -f "$work/c/$output" ]; then
+				if ! cmp -s "$work/c/$output" "$work/p/$output"; then
+					echo "$file ($mode): $output differs"
+					failed=1
+				fi
+			fi
+		done
+		if [ ! -f "$work/c/motion.h" ]; then
+			echo "$file ($mode): no motion.h written"
+			failed=1
+		fi
+	done
+done
+
+if [ $failed -ne 0 ]; then
+	exit 1
+fi
+echo "check_equivalence: $# files, motionc and MotionParser.pl agree"
@@ -0,0 +1,197 @@
+/*
+ * motion_fuzz.cpp - fuzz harness for the motion file parser, runs any input
+ *	through parser, checks and outputs and aborts if an invariant breaks
+ *
+ * Version 0.6
+ */
+
+/*
+ * You may freely modify and share this code, as long as you keep this
+ * notice intact. Licensed under the Creative Commons BY-SA 3.0 license:
+ *
+ *   http://creativecommons.org/licenses/by-sa/3.0/
+ *
+ * Disclaimer: To the extent permitted by law, this work is provided
+ * without any warranty. It might be defective, in which case you agree
+ * to be responsible for all resulting costs and damages.
+ */
+
+// Built with MOTION_FUZZ_LIBFUZZER this is a plain libFuzzer target:
+//   ./motion_fuzz test/corpus
+// Without it the file has its own main() that replays the corpus and a fixed
+// number of seeded mutations of it, so "make check" runs with g++ and the
+// sanitizers only, no clang needed:
+//   ./motion_fuzz_check [-r runs] [-s seed] test/corpus/*.mtn
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "motion_file.h"
+#include "motion_output.h"
+
+// stop with the failed invariant (the sanitizers report the rest)
+static void fuzzCheck(bool condition, const char *what)
+{
+	if( !condition ) {
+		fprintf(stderr, "motion_fuzz - invariant failed: %s\n", what);
+		abort();
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	std::string text(reinterpret_cast<const char *>(data), size);
+	std::vector<MotionDiagnostic> diagnostics;
+	MotionFile motion;
+
+	bool ok = parseMotionText(text, "fuzz.mtn", motion, diagnostics);
+	if( ok ) {
+		ok = validateMotionFile(motion, diagnostics);
+	}
+
+	// a failed file has to say why, and every diagnostic has to print
+	bool have_error = false;
+	for( size_t i = 0; i < diagnostics.size(); i++ ) {
+		have_error |= diagnostics[i].error;
+		fuzzCheck(!formatDiagnostic(diagnostics[i]).empty(), "empty diagnostic");
+	}
+	fuzzCheck(ok != have_error, "result does not match the diagnostics");
+	if( !ok ) {
+		return 0;
+	}
+
+	// a valid file has to compile into both headers and an image that fits
+	fuzzCheck(motion.pages.size() <= MTN_PAGES, "too many pages accepted");
+	CompiledMotion compiled;
+	compileMotion(motion, compiled);
+	fuzzCheck(!motionHeader(compiled, false).empty(), "empty header");
+	fuzzCheck(!motionHeader(compiled, true).empty(), "empty delta header");
+	std::vector<uint8_t> image;
+	if( motionImage(compiled, image) ) {
+		fuzzCheck(!image.empty() && image.size() <= MTN_IMAGE_SLOT_SIZE, "bad image size");
+	}
+	return 0;
+}
+
+#ifndef MOTION_FUZZ_LIBFUZZER
+
+#include <fstream>
+#include <random>
+#include <sstream>
+
+// tokens of the motion file format the mutations insert
+static const char *fuzz_tokens[] = {
+	"page_begin\n", "page_end\n", "step=", "name=", "play_param=", "compliance=",
+	"enable=", "version=", "=", " ", "\t", "\r", "\n", "\xEF\xBB\xBF",
+	"0", "-1", "1023", "1024", "7.5", "1e9", "nan", "inf", "0x10", "99999999999"
+};
+#define FUZZ_TOKENS		(sizeof(fuzz_tokens) / sizeof(fuzz_tokens[0]))
+
+// apply a few random edits to a copy of a corpus file
+static std::string mutateText(const std::string &seed, std::mt19937 &rng)
+{
+	std::string text = seed;
+	int edits = 1 + rng() % ((rng() % 2) ? 2 : 8);
+
+	for( int i = 0; i < edits; i++ )
+	{
+		size_t position = rng() % (text.size() + 1);
+		switch( rng() % 6 )
+		{
+			case 0:		// flip a byte
+				if( !text.empty() ) {
+					text[position % text.size()] = (char) (rng() % 256);
+				}
+				break;
+			case 1:		// delete a run of bytes
+				if( !text.empty() ) {
+					text.erase(position % text.size(), 1 + rng() % 200);
+				}
+				break;
+			case 2:		// insert a token
+				text.insert(position, fuzz_tokens[rng() % FUZZ_TOKENS]);
+				break;
+			case 3:		// duplicate a piece of the text
+				if( !text.empty() ) {
+					size_t from = rng() % text.size();
+					text.insert(position, text.substr(from, rng() % 300));
+				}
+				break;
+			case 4:		// truncate
+				text.resize(position);
+				break;
+			default:	// erase the rest of a line
+			{
+				size_t end = text.find('\n', position);
+				if( end != std::string::npos ) {
+					text.erase(position, end - position);
+				}
+				break;
+			}
+		}
+	}
+	return text;
+}
+
+// Returns	(bool)	true if the file could be read
+static bool readFile(const char *file_name, std::string &text)
+{
+	std::ifstream file(file_name, std::ios::binary);
+	if( !file ) {
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	text = buffer.str();
+	return true;
+}
+
+static void runText(const std::string &text)
+{
+	LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+}
+
+int main(int argc, char **argv)
+{
+	long runs = 10000;
+	unsigned long seed = 1;
+	std::vector<std::string> corpus;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		std::string arg = argv[i];
+		if( (arg == "-r" || arg == "-s") && i + 1 < argc ) {
+			if( arg == "-r" ) {
+				runs = atol(argv[++i]);
+			} else {
+				seed = strtoul(argv[++i], NULL, 10);
+			}
+			continue;
+		}
+		std::string text;
+		if( !readFile(argv[i], text) ) {
+			fprintf(stderr, "motion_fuzz - can't read %s\n", argv[i]);
+			return 1;
+		}
+		corpus.push_back(text);
+	}
+	if( corpus.empty() ) {
+		fprintf(stderr, "Usage: motion_fuzz_check [-r runs] [-s seed] foo.mtn [bar.mtn ...]\n");
+		return 1;
+	}
+
+	// the corpus as is, then mutations of it (same seed, same inputs)
+	for( size_t i = 0; i < corpus.size(); i++ ) {
+		runText(corpus[i]);
+	}
+	std::mt19937 rng(seed);
+	for( long run = 0; run < runs; run++ ) {
+		runText(mutateText(corpus[run % corpus.size()], rng));
+	}
+	printf("motion_fuzz: %zu corpus files, %ld mutations, no failures\n", corpus.size(), runs);
+	return 0;
+}
+
+#endif /* MOTION_FUZZ_LIBFUZZER */
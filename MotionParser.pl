@@ -3,15 +3,33 @@
 use strict;
 use warnings;
 
+# keyframe interval for the delta encoded step data (-d option)
+# the first step of every page is always a keyframe
+my $keyframe_interval = 4;
+# marker byte for a keyframe step in the delta stream (never a valid delta token)
+my $keyframe_marker = 0xFF;
+
 # quit unless we have the correct number of command-line args
 my $num_args = $#ARGV + 1;
+my $delta_mode = 0;
+my $image_mode = 0;
+while ($num_args > 1 && $ARGV[0] =~ /^-[db]$/) {
+	# delta encoded step data
+	if ($ARGV[0] eq "-d") { $delta_mode = 1; }
+	# binary motion image for upload with the LOAD command
+	if ($ARGV[0] eq "-b") { $image_mode = 1; }
+	shift @ARGV;
+	$num_args -= 1;
+}
 if ($num_args != 1) {
 	print "\nNumber of arguments: $num_args\n";
-	print "\nUsage: MotionParser.pl foo.mtn \n";
+	print "\nUsage: MotionParser.pl [-d] [-b] foo.mtn \n";
+	print "       -d  delta encode the step values (saves Flash)\n";
+	print "       -b  also write the binary motion image motion.bin\n";
 	exit;
 }
 
-# we got three command line args, so assume the second is the .mtn file
+# we got the command line args, so assume the last is the .mtn file
 my $motion_file = $ARGV[0];
 print "\nMotion Input File: $motion_file\n";
 my $output_file = "motion.h";
@@ -51,12 +69,12 @@ foreach (@servos) {
 		$active_servos += 1;
 	}
 }
-# number of packed servo values as well
+# number of packed servo values as well (3 per uint32, last one may be partly used)
 my $packed_active_servos = 0;
 # not an elegant way to do this, but it works :)
 if($active_servos > 0) {
 	use integer;
-	$packed_active_servos = $active_servos / 3;
+	$packed_active_servos = ($active_servos + 2) / 3;
 }
 
 if( $file_version == 1.01 ) { 
@@ -79,6 +97,12 @@ print $out " \n";
 print $out "#include <stdint.h>\n";
 print $out "#include <avr/pgmspace.h>\n";
 print $out "#include \"global.h\"\n";
+if( $delta_mode ) {
+	print $out " \n";
+	print $out "// Step values are delta encoded (see motion_f.c for the stream format)\n";
+	print $out "#define MOTION_DELTA_ENCODED\n";
+	print $out "#define MOTION_KEYFRAME_INTERVAL	$keyframe_interval\n";
+}
  
 # Now output the servos as an array so we can test validity of hardware config
 print $out " \n";
@@ -98,6 +122,11 @@ print $out "\n";
 # Next we need to define the struct for a motion page
 my $total_steps = 0;
 my $total_pages = 0;
+my $delta_bytes = 0;
+my %image_pages = ();
+# metadata for the compile-time checks in the firmware
+my $max_steps = 0;
+my $last_page = 0;
 my @motion_pages = ();
 # we also want to keep track of the min and max value for each servo
 my @servo_min_val = ();
@@ -150,6 +179,7 @@ for ($i = 1; $i <= 255; $i++) {
 	$line = <$in>;
 	chomp($line);
 	my @servo_values = ();
+	my @step_raw = ();
 	my @pause_times = ();
 	my @play_times = ();
 	my $steps = 0;
@@ -162,6 +192,7 @@ for ($i = 1; $i <= 255; $i++) {
 		
 		# now we transfer the servo values and play times into an array
 		my @servo_val = split / /, $line;
+		my @raw_values = ();
 		my $j = 0;
 		my $act_srvo = 0;
 		my $count3 = 1;
@@ -173,6 +204,7 @@ for ($i = 1; $i <= 255; $i++) {
 				use integer;
 				if ($servos[$j] == "1" ) { 
 					$act_srvo += 1;
+					push( @raw_values, $servo_val[$j] );
 					# check if we need to update min/max values
 					if($servo_val[$j] > $servo_max_val[$act_srvo-1]) { $servo_max_val[$act_srvo-1] = $servo_val[$j]; }
 					if($servo_val[$j] < $servo_min_val[$act_srvo-1]) { $servo_min_val[$act_srvo-1] = $servo_val[$j]; }
@@ -206,6 +238,11 @@ for ($i = 1; $i <= 255; $i++) {
 			# increment the counter
 			$j += 1;
 		}
+		# push the partly filled last value if servo count is not a multiple of 3
+		if($count3 != 1) {
+			push( @servo_values, $packed_servo_value );
+		}
+		push( @step_raw, [@raw_values] );
 		
 		# read the next line
 		$line = <$in>;
@@ -220,7 +257,78 @@ for ($i = 1; $i <= 255; $i++) {
 		exit;
 	}
 	
-	if( $steps >= 1) {
+	# Apply the page speed rate to the times here, so the firmware plays them as they are
+	# (integer maths as in the firmware before, 0 or 10 means 1.0x)
+	my $speed_rate10 = int($play_param[3]*10 + 0.5);
+	foreach (@pause_times, @play_times) {
+		use integer;
+		my $t = int($_ + 0.5);
+		if( $speed_rate10 != 0 && $speed_rate10 != 10 ) { $t = ($t * 10) / $speed_rate10; }
+		$_ = $t;
+	}
+	# Precompute the effective step time and servo speeds of steps 2..n, the start pose is
+	# the previous step (same model as calculatePoseServoSpeeds in pose.c). The speeds
+	# are stored as speed/4 rounded up in a byte, the first step is calculated live.
+	my @step_times = ( 0 );
+	my @step_speeds = ();
+	for (my $k = 1; $k < $steps; $k++) {
+		use integer;
+		my @travel = ();
+		my $max_travel = 0;
+		for (my $n = 0; $n < $active_servos; $n++) {
+			my $t = abs($step_raw[$k][$n] - $step_raw[$k-1][$n]);
+			push( @travel, $t );
+			if( $t > $max_travel ) { $max_travel = $t; }
+		}
+		my $time = $play_times[$k];
+		my $min_time = (848 * $max_travel + 1022) / 1023;
+		if( $time < $min_time ) { $time = $min_time; }
+		if( $time == 0 ) { $time = 1; }
+		push( @step_times, $time );
+		foreach (@travel) {
+			my $speed = (848 * $_) / $time;
+			if( $speed > 1023 ) { $speed = 1023; }
+			if( $speed < 26 ) { $speed = 26; }
+			$speed = ($speed + 3) / 4;
+			if( $speed > 255 ) { $speed = 255; }
+			push( @step_speeds, $speed );
+		}
+	}
+	
+	if( $steps > $max_steps ) { $max_steps = $steps; }
+	if( $steps >= 1 ) { $last_page = $i; }
+	
+	# The delta encoded byte layout (used by -d and -b): the header is the same
+	# as the struct below, but the times come before the variable length steps
+	my @page_bytes = ();
+	if( $steps >= 1 ) {
+		@page_bytes = ( @flex_values, $play_param[0], $play_param[1], $play_param[2], $speed_rate10, $play_param[4], $steps );
+		foreach (@pause_times, @play_times, @step_times) {
+			push( @page_bytes, $_ & 0xFF, ($_ >> 8) & 0xFF );
+		}
+		push( @page_bytes, @step_speeds );
+		push( @page_bytes, encode_delta_steps(\@step_raw) );
+		$image_pages{$i} = [@page_bytes];
+	}
+	
+	if( $steps >= 1 && $delta_mode ) {
+		# increase the number of active pages to calculate total
+		$total_pages += 1;
+		push( @motion_pages, $i );
+		# Output the motion page as a byte array
+		$delta_bytes += @page_bytes;
+		print $out "// $page_name \n";
+		print $out "const uint8 MotionPage$i\[\] PROGMEM = { \n";
+		my $j = 0;
+		foreach (@page_bytes) {
+			print $out "$_";
+			if( $j != @page_bytes-1 ) { print $out ","; }
+			if( ($j % 24) == 23 ) { print $out "\n"; }
+			$j += 1;
+		}
+		print $out "}; \n\n";
+	}
+	elsif( $steps >= 1) {
 		# increase the number of active pages to calculate total
 		$total_pages += 1;
 		push( @motion_pages, $i );
@@ -237,6 +345,8 @@ for ($i = 1; $i <= 255; $i++) {
 		print $out "   const uint32 StepValues[$steps][$packed_active_servos]; \n";
 		print $out "   const uint16 PauseTime[$steps]; \n";
 		print $out "   const uint16 PlayTime[$steps]; \n";
+		print $out "   const uint16 StepTime[$steps]; \n";
+		if( $steps > 1 ) { print $out "   const uint8 StepSpeeds[". ($steps-1) ."][$active_servos]; \n"; }
 		# now we can add the initialisers to the struct
 		print $out "} MotionPage$i PROGMEM = { \n";
 		# first the joint flexibility values
@@ -275,12 +385,34 @@ for ($i = 1; $i <= 255; $i++) {
 		$j = 0;
 		print $out "{";
 		foreach (@play_times) {
-			if( $j != @play_times-1 ) { print $out "$_,"; } else { print $out "$_} \n"; }
+			if( $j != @play_times-1 ) { print $out "$_,"; } else { print $out "$_}, \n"; }
 			$j += 1;
 		}
+		# and the precomputed step times and speeds
+		print $out "{". join(",", @step_times) ."}";
+		if( $steps > 1 ) {
+			print $out ", \n{";
+			for ($j = 0; $j < $steps-1; $j++) {
+				print $out "{". join(",", @step_speeds[$j*$active_servos .. ($j+1)*$active_servos-1]) ."}";
+				if( $j != $steps-2 ) { print $out ","; }
+			}
+			print $out "}";
+		}
+		print $out " \n";
 		print $out "}; \n\n";
 	}
 }
+# Calculate total memory use, the firmware checks we stay below 64KBytes
+my $total_memory = $total_steps * ($packed_active_servos*4 + 2 + 2 + 2);
+$total_memory += $total_pages*($active_servos + 6);
+$total_memory += ($total_steps - $total_pages)*$active_servos;
+if( $delta_mode ) {
+	print "Delta encoding uses $delta_bytes instead of $total_memory bytes.\n";
+	$total_memory = $delta_bytes;
+}
+# plus the page index
+$total_memory += 256 + 2*$total_pages;
+
 # finally we know the number of active motion pages
 print $out "// Number of active motion pages in this file \n";
 print $out "const uint8 ACTIVE_MOTION_PAGES = $total_pages; \n\n";
@@ -298,27 +430,146 @@ foreach(@servo_min_val) {
 	$j += 1;
 }
 print $out "\n";
+
+# metadata of the motion file, checked against global.h at compile time (see motion_f.c)
+my $min_value = 1023;
+my $max_value = 0;
+foreach (@servo_min_val) { if( $_ < $min_value ) { $min_value = $_; } }
+foreach (@servo_max_val) { if( $_ > $max_value ) { $max_value = $_; } }
+print $out "// Motion file metadata for the compile-time checks \n";
+print $out "#define MOTION_FILE_SERVOS		$active_servos \n";
+print $out "#define MOTION_FILE_PAGES		$total_pages \n";
+print $out "#define MOTION_FILE_LAST_PAGE	$last_page \n";
+print $out "#define MOTION_FILE_MAX_STEPS	$max_steps \n";
+print $out "#define MOTION_FILE_MIN_VALUE	$min_value \n";
+print $out "#define MOTION_FILE_MAX_VALUE	$max_value \n";
+print $out "#define MOTION_FILE_BYTES		$total_memory \n";
+print $out "// Play and pause times already include the page speed rate \n";
+print $out "#define MOTION_TIMES_PRESCALED \n";
+print $out "\n";
+
+# The page index lives in Flash: a page number to slot table and a dense
+# table of page addresses, one slot per active page
+print $out "// Motion page index - slot in MOTION_PAGE_TABLE for each page number \n";
+print $out "#define MOTION_PAGE_NONE	0xFF \n";
+print $out "const uint8 MOTION_PAGE_INDEX[256] PROGMEM = { \n";
+my %page_slot = ();
+$j = 0;
+foreach (@motion_pages) { $page_slot{$_} = $j; $j += 1; }
+for ($j = 0; $j < 256; $j++) {
+	if( exists $page_slot{$j} ) { print $out "$page_slot{$j}"; } else { print $out "MOTION_PAGE_NONE"; }
+	if( $j != 255 ) { print $out ","; }
+	if( ($j % 16) == 15 ) { print $out "\n"; }
+}
+print $out "}; \n";
+print $out "// Flash address of each active motion page \n";
+print $out "const uint8 * const MOTION_PAGE_TABLE[$total_pages] PROGMEM = { \n";
+$j = 0;
+foreach (@motion_pages) {
+	if( $delta_mode ) { print $out "(const uint8 *) MotionPage$_"; } else { print $out "(const uint8 *) &MotionPage$_"; }
+	if( $j != @motion_pages-1 ) { print $out ","; }
+	if( ($j % 4) == 3 ) { print $out "\n"; }
+	$j += 1;
+}
+print $out "}; \n\n";
 print $out "#endif /* MOTION_H_ */";
 
 # Total number of steps in the motion file
 print "Complete - $total_pages pages and $total_steps motion steps processed.\n"; 
-# Finally calculate total memory use to check we stay below 64KBytes
-my $total_memory = $total_steps * ($packed_active_servos*4 + 2 + 2);
-$total_memory += $total_pages*($active_servos + 6);
-print "Total memory use is $total_memory bytes. Check value is below 64KB!\n";
+print "Total memory use is $total_memory bytes (checked against 64KB at compile time).\n";
 
 # Close the input and output files
 close $in;
 close $out;
 
-# we also need to auto-generate the code for motionPageInit to create the pointers
-open($out, ">", "motionPageInit.c") or die "Can't open output header file: $!";
+# and the binary motion image if requested
+if( $image_mode ) {
+	write_motion_image("motion.bin");
+}
 
-print $out "	// Motion Page pointer assignment to PROGMEM \n";
-print $out "	motion_pointer[0] = NULL; \n";
-foreach (@motion_pages) {
-	print $out "	motion_pointer[$_] = (uint8*) &MotionPage$_; \n";
+# Delta encode the servo values of the steps of one page
+# Keyframe steps:  marker byte 0xFF followed by each value as high byte, low byte
+# Other steps:     tokens for the change of each value from the previous step
+#   0xxxxxxx            one delta, zigzag encoded in 7 bits (-64..63)
+#   10nnnnnn            run of nnnnnn+1 unchanged values (1..64)
+#   11xxxxxx xxxxxxxx   one delta, zigzag encoded in 14 bits
+sub encode_delta_steps {
+	my ($steps_ref) = @_;
+	my @bytes = ();
+	my @previous = ();
+	my $step = 0;
+	foreach my $values (@{$steps_ref}) {
+		if( ($step % $keyframe_interval) == 0 ) {
+			push( @bytes, $keyframe_marker );
+			foreach (@{$values}) { push( @bytes, ($_ >> 8) & 0xFF, $_ & 0xFF ); }
+		} else {
+			my $run = 0;
+			for( my $k = 0; $k < @{$values}; $k++ ) {
+				my $delta = $values->[$k] - $previous[$k];
+				if( $delta == 0 ) {
+					$run += 1;
+					if( $run == 64 ) { push( @bytes, 0x80 | ($run-1) ); $run = 0; }
+					next;
+				}
+				if( $run > 0 ) { push( @bytes, 0x80 | ($run-1) ); $run = 0; }
+				my $zigzag = ($delta >= 0) ? ($delta << 1) : ((-$delta << 1) - 1);
+				if( $zigzag < 128 ) {
+					push( @bytes, $zigzag );
+				} else {
+					push( @bytes, 0xC0 | (($zigzag >> 8) & 0x3F), $zigzag & 0xFF );
+				}
+			}
+			if( $run > 0 ) { push( @bytes, 0x80 | ($run-1) ); }
+		}
+		@previous = @{$values};
+		$step += 1;
+	}
+	return @bytes;
 }
-print $out "\n";
 
-close $out;
+# CRC16 as calculated by avr-libc _crc16_update (polynomial 0xA001, init 0xFFFF)
+sub crc16 {
+	my $crc = 0xFFFF;
+	foreach my $byte (@_) {
+		$crc ^= $byte;
+		for (my $b = 0; $b < 8; $b++) {
+			if( $crc & 1 ) { $crc = ($crc >> 1) ^ 0xA001; } else { $crc >>= 1; }
+		}
+	}
+	return $crc;
+}
+
+# Write the binary motion image (layout see motion_image.h in the firmware)
+#   header   'B','M','I',version (3 = with step times and speeds), servos, pages, flags, keyframe interval,
+#            uint32 length, uint16 crc, uint16 reserved
+#   limits   servo min values, servo max values (uint16 each)
+#   index    page number (uint8), page offset from image start (uint16)
+#   pages    delta encoded pages
+sub write_motion_image {
+	my ($file_name) = @_;
+	my @pages = sort { $a <=> $b } keys %image_pages;
+	my $header_size = 16;
+	my $offset = $header_size + 4*$active_servos + 3*@pages;
+	my @index = ();
+	my @data = ();
+	foreach (@pages) {
+		push( @index, $_, $offset & 0xFF, ($offset >> 8) & 0xFF );
+		push( @data, @{$image_pages{$_}} );
+		$offset += @{$image_pages{$_}};
+	}
+	my @limits = ();
+	foreach (@servo_min_val, @servo_max_val) { push( @limits, $_ & 0xFF, ($_ >> 8) & 0xFF ); }
+	my @body = ( @limits, @index, @data );
+	my $length = $header_size + @body;
+	if( $length > 0xF000 ) {
+		print STDERR "Motion image is $length bytes and does not fit a 60KB slot!\n";
+		exit;
+	}
+	my $header = pack( "a3 C C C C C V v v", "BMI", 3, $active_servos, scalar(@pages), 1, $keyframe_interval, $length, crc16(@body), 0 );
+	my $bin;
+	open($bin, ">", $file_name) or die "Can't open motion image file: $!";
+	binmode $bin;
+	print $bin $header . pack( "C*", @body );
+	close $bin;
+	print "Motion image $file_name written - ". scalar(@pages) ." pages, $length bytes.\n";
+}
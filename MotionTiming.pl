@@ -0,0 +1,214 @@
+
+#using perl
+use strict;
+use warnings;
+
+# Offline timing analysis of a RoboPlus motion file.
+# Replays every page with the speed model of calculatePoseServoSpeeds() in pose.c
+# and writes one CSV row per step and per page. With -c the page totals are
+# compared against a baseline CSV and the exit code is 1 on a timing regression.
+
+# speed model constants from pose.c
+my $speed_factor = 848;		# ms * speed units per position unit (59 RPM)
+my $max_speed = 1023;
+my $min_speed = 26;
+
+# command-line options
+my $baseline_file = "";
+my $tolerance = 5;			# percent the page total may grow before -c fails
+my $fastest = 0;			# POSE_TIMING_FASTEST instead of POSE_TIMING_AS_AUTHORED
+my $output_file = "";
+while (@ARGV > 1 && $ARGV[0] =~ /^-[ctfo]$/) {
+	my $opt = shift @ARGV;
+	if ($opt eq "-c") { $baseline_file = shift @ARGV; }
+	elsif ($opt eq "-t") { $tolerance = shift @ARGV; }
+	elsif ($opt eq "-f") { $fastest = 1; }
+	elsif ($opt eq "-o") { $output_file = shift @ARGV; }
+}
+if (@ARGV != 1) {
+	print "\nUsage: MotionTiming.pl [-f] [-o timing.csv] [-c baseline.csv [-t percent]] foo.mtn \n";
+	print "       -f  compress every step to the fastest feasible time (POSE_TIMING_FASTEST)\n";
+	print "       -o  write the CSV to a file instead of stdout\n";
+	print "       -c  fail (exit code 1) if a page got slower than in the baseline CSV\n";
+	print "       -t  allowed growth of the page total time in percent (default 5)\n";
+	exit;
+}
+my $motion_file = $ARGV[0];
+
+# read the motion file (same format as MotionParser.pl)
+open(my $in, "<", $motion_file) or die "Can't open input motion file: $!";
+my $line = <$in>;
+if( $line !~ /motion/ ) {
+	print STDERR "$motion_file - This is not a motion file!\n";
+	exit 1;
+}
+$line = <$in>;
+chomp($line);
+$line =~ s/version=//;
+my $file_version = $line;
+$line = <$in>;
+chomp($line);
+$line =~ s/enable=//;
+my @servos = split / /, $line;
+# Dynamixel IDs of the active servos
+my @servo_ids = ();
+for (my $j = 0; $j <= 25; $j++) {
+	if( $servos[$j] == 1 ) { push( @servo_ids, $j ); }
+}
+if( $file_version == 1.01 ) {
+	# motor type line
+	$line = <$in>;
+}
+
+my %pages = ();
+for (my $i = 1; $i <= 255; $i++) {
+	$line = <$in>;
+	if( !defined($line) || $line !~ /page_begin/ ) {
+		print STDERR "Motion Page $i - Page Begin not found!\n";
+		exit 1;
+	}
+	$line = <$in>;			# name
+	$line = <$in>;			# compliance
+	$line = <$in>;
+	chomp($line);
+	$line =~ s/play_param=//;
+	my @play_param = split / /, $line;
+	my @steps = ();
+	$line = <$in>;
+	chomp($line);
+	while( $line =~ /step=/ ) {
+		$line =~ s/step=//;
+		my @val = split / /, $line;
+		my @pose = ();
+		foreach (@servo_ids) { push( @pose, $val[$_] ); }
+		push( @steps, { pose => [@pose], pause => int($val[26]*1000 + 0.5), play => int($val[27]*1000 + 0.5) } );
+		$line = <$in>;
+		chomp($line);
+	}
+	if( @steps > 0 ) {
+		$pages{$i} = { next => $play_param[0], exit => $play_param[1], repeat => $play_param[2],
+			speed_rate10 => int($play_param[3]*10 + 0.5), steps => [@steps] };
+	}
+}
+close $in;
+
+# the pose before the first step of a page: the last step of a page that chains
+# to it via NextPage, or its own last step if it repeats, otherwise unknown
+my %start_pose = ();
+my %start_kind = ();
+foreach my $p (sort { $a <=> $b } keys %pages) {
+	my $next = $pages{$p}{next};
+	if( $next != 0 && exists $pages{$next} && !exists $start_pose{$next} ) {
+		$start_pose{$next} = $pages{$p}{steps}[-1]{pose};
+		$start_kind{$next} = "chain";
+	}
+}
+foreach my $p (keys %pages) {
+	if( !exists $start_pose{$p} && $pages{$p}{repeat} > 1 ) {
+		$start_pose{$p} = $pages{$p}{steps}[-1]{pose};
+		$start_kind{$p} = "repeat";
+	}
+}
+
+# scale a time by the page speed rate like scaleMotionTime() in motion_f.c
+sub scale_time {
+	my ($time, $rate10) = @_;
+	return $time if( $rate10 == 0 || $rate10 == 10 );
+	use integer;
+	return ($time * 10) / $rate10;
+}
+
+my $out = \*STDOUT;
+if( $output_file ne "" ) {
+	open($out, ">", $output_file) or die "Can't open output file: $!";
+}
+print $out "record,page,step,repeat,speed_rate10,authored_ms,scaled_ms,min_ms,actual_ms,pause_ms,late_ms,bottleneck_id,min_speed_joints,start,total_ms,speed_inflation_ms,repeat_inflation_ms\n";
+
+my %page_total = ();
+my %page_late = ();
+foreach my $p (sort { $a <=> $b } keys %pages) {
+	my $page = $pages{$p};
+	my $rate10 = $page->{speed_rate10};
+	my $repeat = $page->{repeat} > 0 ? $page->{repeat} : 1;
+	my $previous = exists $start_pose{$p} ? $start_pose{$p} : $page->{steps}[0]{pose};
+	my $start = exists $start_kind{$p} ? $start_kind{$p} : "unknown";
+	my ($sum_authored, $sum_scaled, $sum_min, $sum_actual, $sum_pause, $sum_late) = (0, 0, 0, 0, 0, 0);
+	my $step_no = 0;
+	foreach my $step (@{$page->{steps}}) {
+		$step_no += 1;
+		# travel of every joint from the previous pose, bottleneck is the longest
+		my ($max_travel, $bottleneck) = (0, 0);
+		my @travel = ();
+		for (my $k = 0; $k < @servo_ids; $k++) {
+			my $t = abs($step->{pose}[$k] - $previous->[$k]);
+			push( @travel, $t );
+			if( $t > $max_travel ) { $max_travel = $t; $bottleneck = $k; }
+		}
+		my $scaled = scale_time($step->{play}, $rate10);
+		my $pause = scale_time($step->{pause}, $rate10);
+		my $min_time;
+		{
+			use integer;
+			$min_time = ($speed_factor * $max_travel + $max_speed - 1) / $max_speed;
+		}
+		my $actual = ($fastest || $scaled < $min_time) ? $min_time : $scaled;
+		$actual = 1 if( $actual == 0 );
+		# joints that get the minimum speed arrive before the bottleneck
+		my $slow = 0;
+		foreach (@travel) {
+			use integer;
+			$slow += 1 if( ($speed_factor * $_) / $actual < $min_speed );
+		}
+		my $late = ($actual > $scaled) ? $actual - $scaled : 0;
+		my $authored = $step->{play} + $step->{pause};
+		my $bottleneck_id = ($max_travel > 0) ? $servo_ids[$bottleneck] : "";
+		print $out "step,$p,$step_no,$repeat,$rate10,$authored,". ($scaled + $pause) .",$min_time,$actual,$pause,$late,$bottleneck_id,$slow,";
+		print $out ($step_no == 1 ? $start : "step") .",". ($actual + $pause) .",". ($scaled + $pause - $authored) .",\n";
+		$sum_authored += $authored;
+		$sum_scaled += $scaled + $pause;
+		$sum_min += $min_time;
+		$sum_actual += $actual + $pause;
+		$sum_pause += $pause;
+		$sum_late += $late;
+		$previous = $step->{pose};
+	}
+	my $total = $sum_actual * $repeat;
+	print $out "page,$p,,$repeat,$rate10,$sum_authored,$sum_scaled,$sum_min,$sum_actual,$sum_pause,$sum_late,,,$start,$total,";
+	print $out ($sum_scaled - $sum_authored) .",". ($sum_actual * ($repeat - 1)) ."\n";
+	$page_total{$p} = $total;
+	$page_late{$p} = $sum_late * $repeat;
+}
+close $out if( $output_file ne "" );
+
+# timing regression check against a baseline CSV
+exit 0 if( $baseline_file eq "" );
+open(my $base, "<", $baseline_file) or die "Can't open baseline file: $!";
+my $header = <$base>;
+chomp($header);
+my @columns = split /,/, $header;
+my %col = ();
+for (my $k = 0; $k < @columns; $k++) { $col{$columns[$k]} = $k; }
+my $regressions = 0;
+while( my $row = <$base> ) {
+	chomp($row);
+	my @f = split /,/, $row, -1;
+	next if( $f[$col{record}] ne "page" );
+	my $p = $f[$col{page}];
+	next if( !exists $page_total{$p} );
+	my $limit = $f[$col{total_ms}] * (100 + $tolerance) / 100;
+	if( $page_total{$p} > $limit ) {
+		print STDERR "Page $p: total $page_total{$p} ms, baseline $f[$col{total_ms}] ms\n";
+		$regressions += 1;
+	}
+	my $base_late = $f[$col{late_ms}] * ($f[$col{repeat}] > 0 ? $f[$col{repeat}] : 1);
+	if( $page_late{$p} > $base_late ) {
+		print STDERR "Page $p: late by $page_late{$p} ms, baseline $base_late ms\n";
+		$regressions += 1;
+	}
+}
+close $base;
+if( $regressions > 0 ) {
+	print STDERR "$regressions timing regressions against $baseline_file\n";
+	exit 1;
+}
+exit 0;
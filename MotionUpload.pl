@@ -0,0 +1,81 @@
+
+#using perl
+use strict;
+use warnings;
+
+# Uploads a motion image written by MotionParser.pl -b to the CM-510
+# The firmware needs MOTION_IMAGE_UPLOAD (global.h) and serial commands enabled.
+
+# protocol bytes and block size, see motion_image.h in the firmware
+my $ack = 0x06;
+my $nak = 0x15;
+my $block_size = 256;		# SPM_PAGESIZE of the ATmega2561
+my $timeout = 5;			# seconds to wait for each reply
+
+# quit unless we have the correct number of command-line args
+my $num_args = $#ARGV + 1;
+if ($num_args != 2) {
+	print "\nNumber of arguments: $num_args\n";
+	print "\nUsage: MotionUpload.pl /dev/ttyUSB0 motion.bin \n";
+	exit;
+}
+my ($port, $image_file) = @ARGV;
+
+# read the whole image
+my $in;
+open($in, "<", $image_file) or die "Can't open motion image: $!";
+binmode $in;
+my $image = do { local $/; <$in> };
+close $in;
+if( length($image) < 16 || substr($image, 0, 3) ne "BMI" ) {
+	print STDERR "$image_file is not a motion image!\n";
+	exit 1;
+}
+
+# the CM-510 serial port runs at 57600 baud (see serial_init)
+system("stty", "-F", $port, "57600", "raw", "-echo") == 0 or die "Can't configure $port\n";
+my $dev;
+open($dev, "+<", $port) or die "Can't open $port: $!";
+binmode $dev;
+
+# wait for a reply byte, skipping any text the firmware prints
+sub wait_reply {
+	my $rin = '';
+	vec($rin, fileno($dev), 1) = 1;
+	while( select(my $rout = $rin, undef, undef, $timeout) ) {
+		my $c;
+		last if( sysread($dev, $c, 1) != 1 );
+		my $byte = ord($c);
+		return $byte if( $byte == $ack || $byte == $nak );
+	}
+	return -1;
+}
+
+# start the upload with the LOAD command
+syswrite($dev, "LOAD\r");
+if( wait_reply() != $ack ) {
+	print STDERR "No reply to LOAD command!\n";
+	exit 1;
+}
+
+# then send the image in Flash page sized blocks
+my $sent = 0;
+while( $sent < length($image) ) {
+	my $block = substr($image, $sent, $block_size);
+	syswrite($dev, $block);
+	$sent += length($block);
+	my $reply = wait_reply();
+	if( $reply != $ack ) {
+		print STDERR "\nUpload failed after $sent bytes!\n";
+		exit 1;
+	}
+	print "\rSent $sent of ". length($image) ." bytes";
+}
+
+# the last reply tells us if the firmware switched to the new image
+if( wait_reply() != $ack ) {
+	print STDERR "\nImage rejected by the CM-510 (CRC check failed)!\n";
+	exit 1;
+}
+print "\nMotion image active.\n";
+close $dev;